@@ -0,0 +1,513 @@
+#include <tulip/TulipPluginHeaders.h>
+#include <tulip/TlpTools.h>
+#include <tulip/PluginLibraryLoader.h>
+#include <tulip/SimplePluginProgress.h>
+#include <tulip/StringCollection.h>
+
+#include <itkVectorImage.h>
+#include <itkImageFileWriter.h>
+#include <itkTimeProbe.h>
+
+#include <QDir>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "ImageIOUtils.h"
+#include "MetaImageUtils.h"
+#include "PhaseStatistics.h"
+#include "SliceSeries.h"
+
+/*
+ * Runs the "Import image", "Load image data" and "Export image" plugins on a
+ * synthetic volume, and reports the throughput and the peak memory of each
+ * phase, followed by the steps of the plugins read from their statistics
+ * (e.g. building the grid and filling the properties), as JSON or CSV. See the
+ * "Benchmark" section of the README.
+ */
+
+namespace {
+
+struct Options
+{
+	uint64_t size[3];
+	unsigned int components;
+	std::string type;
+	std::string propertyType;
+	std::string inputFormat;
+	unsigned int threads;
+	std::string workDir;
+	std::vector< std::string > exportPatterns;
+	std::string pluginsDir;
+	std::string format;
+	std::string output;
+
+	Options() :
+		components(1), type("uchar"), inputFormat("mha"), threads(0), workDir(QDir::temp().filePath("image3d-benchmark").toStdString()),
+		pluginsDir(IMAGE3D_BENCHMARK_PLUGINS_DIR), format("json")
+	{
+		size[0] = 256; size[1] = 256; size[2] = 64;
+	}
+
+	uint64_t numberOfVoxels() const { return size[0] * size[1] * size[2]; }
+
+	bool series() const { return inputFormat == "png"; }
+};
+
+struct PhaseResult
+{
+	std::string name;
+	double seconds;
+	uint64_t voxels;
+	long peakMemory; // kB, -1 when unknown (steps of a plugin)
+};
+
+void usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [options]" << std::endl
+	          << "  --size WxHxD          dimensions of the volume, D = 1 for a 2D image (default 256x256x64)" << std::endl
+	          << "  --components N        number of components per voxel (default 1)" << std::endl
+	          << "  --type T              component type: uchar, ushort, short, int, float or double (default uchar)" << std::endl
+	          << "  --property-type T     \"Property type\" of the import (default Integer/Double, or IntegerVector/DoubleVector)" << std::endl
+	          << "  --input-format F      synthetic volume read by the plugins: mha, compressed-mha or png (default mha)" << std::endl
+	          << "  --threads N           threads of the plugins, 0 for one per core (default 0)" << std::endl
+	          << "  --work-dir DIR        directory of the generated and exported images" << std::endl
+	          << "  --export-pattern P    \"Export pattern\" of an export run, may be repeated (default export.mha and export%03d.png)" << std::endl
+	          << "  --plugins DIR         directory of the plugins to benchmark" << std::endl
+	          << "  --format json|csv     format of the results (default json)" << std::endl
+	          << "  --output FILE         file of the results (default standard output)" << std::endl;
+}
+
+uint64_t parseNumber(const std::string &option, const std::string &value)
+{
+	char *end = NULL;
+	const long n = strtol(value.c_str(), &end, 10);
+	if(value.empty() || *end != '\0' || n < 0)
+		throw std::runtime_error("Invalid value \"" + value + "\" for " + option);
+	return n;
+}
+
+Options parseArguments(int argc, char **argv)
+{
+	Options options;
+	for(int i = 1; i < argc; ++i) {
+		const std::string option(argv[i]);
+		if(option == "--help" || option == "-h") {
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		}
+
+		if(i + 1 >= argc)
+			throw std::runtime_error("Missing value for " + option);
+		const std::string value(argv[++i]);
+
+		if(option == "--size") {
+			std::istringstream in(value);
+			char x1 = 0, x2 = 0;
+			in >> options.size[0] >> x1 >> options.size[1] >> x2 >> options.size[2];
+			if(in.fail() || x1 != 'x' || x2 != 'x' || !in.eof() || options.numberOfVoxels() == 0)
+				throw std::runtime_error("The size must be of the form WxHxD");
+		} else if(option == "--components") {
+			options.components = parseNumber(option, value);
+			if(options.components == 0)
+				throw std::runtime_error("The number of components must be greater than 0");
+		} else if(option == "--type") {
+			options.type = value;
+		} else if(option == "--property-type") {
+			options.propertyType = value;
+		} else if(option == "--input-format") {
+			if(value != "mha" && value != "compressed-mha" && value != "png")
+				throw std::runtime_error("The input format must be mha, compressed-mha or png");
+			options.inputFormat = value;
+		} else if(option == "--threads") {
+			options.threads = parseNumber(option, value);
+		} else if(option == "--work-dir") {
+			options.workDir = value;
+		} else if(option == "--export-pattern") {
+			options.exportPatterns.push_back(value);
+		} else if(option == "--plugins") {
+			options.pluginsDir = value;
+		} else if(option == "--format") {
+			if(value != "json" && value != "csv")
+				throw std::runtime_error("The format must be json or csv");
+			options.format = value;
+		} else if(option == "--output") {
+			options.output = value;
+		} else {
+			throw std::runtime_error("Unknown option " + option);
+		}
+	}
+
+	if(options.series() && ((options.type != "uchar" && options.type != "ushort") || options.components > 4))
+		throw std::runtime_error("PNG slices hold uchar or ushort components, at most 4 per voxel");
+
+	const bool real = options.type == "float" || options.type == "double";
+	if(options.propertyType.empty()) {
+		if(options.components == 1)
+			options.propertyType = real ? "Double" : "Integer";
+		else
+			options.propertyType = real ? "DoubleVector" : "IntegerVector";
+	}
+
+	// Both export paths: the mapped MetaImage writer and the slice series encoders.
+	if(options.exportPatterns.empty()) {
+		options.exportPatterns.push_back("export.mha");
+		options.exportPatterns.push_back("export%03d.png");
+	}
+
+	return options;
+}
+
+itk::ImageIOBase::IOComponentType componentType(const std::string &type)
+{
+	if(type == "uchar")  return itk::ImageIOBase::UCHAR;
+	if(type == "ushort") return itk::ImageIOBase::USHORT;
+	if(type == "short")  return itk::ImageIOBase::SHORT;
+	if(type == "int")    return itk::ImageIOBase::INT;
+	if(type == "float")  return itk::ImageIOBase::FLOAT;
+	if(type == "double") return itk::ImageIOBase::DOUBLE;
+	throw std::runtime_error("Unknown component type \"" + type + "\"");
+}
+
+/**
+ * Writes a deterministic volume, whose values vary along every axis and
+ * component (a constant volume would favor the caches and the encoders), as
+ * a single MetaImage file (compressed or not) or as a series of PNG slices.
+ */
+class SyntheticVolumeWriter
+{
+private:
+	const Options &options;
+	const std::string &file;
+	const std::vector< std::string > &series;
+
+	template <typename TPixel, unsigned int VDimension>
+	void write(const std::string &fileName, const uint64_t firstSlice, const uint64_t numberOfSlices)
+	{
+		typedef itk::VectorImage< TPixel, VDimension > ImageType;
+		typedef itk::ImageFileWriter< ImageType > WriterType;
+
+		typename ImageType::SizeType size;
+		for(unsigned int i = 0; i < VDimension; ++i)
+			size[i] = i < 2 ? options.size[i] : numberOfSlices;
+		typename ImageType::IndexType index;
+		index.Fill(0);
+
+		typename ImageType::Pointer image = ImageType::New();
+		image->SetRegions(typename ImageType::RegionType(index, size));
+		image->SetNumberOfComponentsPerPixel(options.components);
+		image->Allocate();
+
+		TPixel *pixel = image->GetBufferPointer();
+		for(uint64_t z = firstSlice; z < firstSlice + numberOfSlices; ++z) {
+			for(uint64_t y = 0; y < options.size[1]; ++y) {
+				for(uint64_t x = 0; x < options.size[0]; ++x) {
+					for(unsigned int c = 0; c < options.components; ++c)
+						*pixel++ = static_cast< TPixel >((x * 7 + y * 13 + z * 31 + c * 61) % 251);
+				}
+			}
+		}
+
+		typename WriterType::Pointer writer = WriterType::New();
+		writer->SetFileName(fileName);
+		writer->SetInput(image);
+		writer->SetUseCompression(options.inputFormat == "compressed-mha");
+		try {
+			writer->Update();
+		} catch(itk::ExceptionObject &) {
+			throw std::runtime_error("Unable to write the synthetic volume to \"" + fileName + "\"");
+		}
+	}
+
+public:
+	SyntheticVolumeWriter(const Options &options, const std::string &file, const std::vector< std::string > &series) :
+		options(options), file(file), series(series)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		if(options.series()) {
+			for(uint64_t z = 0; z < options.size[2]; ++z)
+				write< TPixel, 2 >(series[z], z, 1);
+		} else if(options.size[2] == 1) {
+			write< TPixel, 2 >(file, 0, 1);
+		} else {
+			write< TPixel, 3 >(file, 0, options.size[2]);
+		}
+	}
+};
+
+/**
+ * Starts the measure of the peak memory of a phase. On Linux, the peak
+ * resident set size of the process is reset, so that each phase reports its
+ * own peak instead of the peak since the start of the benchmark.
+ */
+void resetPeakMemory()
+{
+#if defined(__linux__)
+	std::ofstream clearRefs("/proc/self/clear_refs");
+	clearRefs << "5";
+#endif
+}
+
+/**
+ * Peak resident set size (in kB) since the last reset (or since the start of
+ * the process, when it cannot be reset), -1 when unknown.
+ */
+long peakMemory()
+{
+#if defined(__linux__)
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while(std::getline(status, line)) {
+		if(line.compare(0, 6, "VmHWM:") == 0)
+			return strtol(line.c_str() + 6, NULL, 10);
+	}
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+		return usage.ru_maxrss / 1024; // bytes
+#else
+		return usage.ru_maxrss;
+#endif
+	}
+#endif
+	return -1;
+}
+
+class Benchmark
+{
+private:
+	const Options &options;
+	std::vector< PhaseResult > results;
+	itk::TimeProbe probe;
+
+	void start()
+	{
+		resetPeakMemory();
+		probe.Reset();
+		probe.Start();
+	}
+
+	void stop(const std::string &name)
+	{
+		probe.Stop();
+		PhaseResult result;
+		result.name = name;
+		result.seconds = probe.GetTotal();
+		result.voxels = options.numberOfVoxels();
+		result.peakMemory = peakMemory();
+		results.push_back(result);
+	}
+
+	/**
+	 * Adds the steps of the last run of a plugin, read from the image3d_stats
+	 * attribute of the graph, after the phase of the run: their time and
+	 * voxels, their peak memory being unknown. The steps are named after the
+	 * phase, e.g. "import: grid" or "load: load: decode" (a detail of the
+	 * "load" step).
+	 */
+	void addSteps(const std::string &phase, tlp::Graph *graph)
+	{
+		std::string statistics;
+		if(!graph->getAttribute< std::string >(STATISTICS_ATTRIBUTE, statistics))
+			return;
+
+		std::istringstream lines(statistics);
+		std::string line, step;
+		std::getline(lines, line); // Name of the plugin.
+		while(std::getline(lines, line)) {
+			const bool detail = line.compare(0, 2, "  ") == 0;
+			const std::string::size_type begin = detail ? 2 : 0, colon = line.find(": ", begin);
+			if(colon == std::string::npos)
+				continue;
+
+			const std::string name = line.substr(begin, colon - begin);
+			if(!detail && name == "total")
+				continue;
+			if(!detail)
+				step = name;
+
+			PhaseResult result;
+			result.name = phase + ": " + (detail ? step + ": " + name : name);
+			result.voxels = 0;
+			result.peakMemory = -1;
+
+			// "<seconds> s, <voxels> voxels, <memory> kB", or "<seconds> s" for a detail.
+			std::istringstream values(line.substr(colon + 2));
+			std::string unit;
+			values >> result.seconds >> unit;
+			if(!detail)
+				values >> result.voxels;
+			if(values.fail())
+				throw std::runtime_error("Unable to read the statistics of the " + phase + " phase: \"" + line + "\"");
+			results.push_back(result);
+		}
+	}
+
+	static void setCollection(tlp::DataSet &dataSet, const std::string &name, const std::string &value)
+	{
+		tlp::StringCollection collection;
+		dataSet.get(name, collection);
+		if(!collection.setCurrent(value))
+			throw std::runtime_error("Invalid value \"" + value + "\" for the \"" + name + "\" parameter");
+		dataSet.set(name, collection);
+	}
+
+public:
+	Benchmark(const Options &options) :
+		options(options)
+	{}
+
+	void run()
+	{
+		if(!QDir().mkpath(QString::fromStdString(options.workDir)))
+			throw std::runtime_error("Unable to create the directory \"" + options.workDir + "\"");
+
+		const QDir workDir(QString::fromStdString(options.workDir));
+		const std::string volumeFile = options.series() ? "" : workDir.filePath("synthetic.mha").toStdString();
+		const std::string seriesPattern = options.series() ? workDir.filePath("synthetic%03d.png").toStdString() : "";
+		const std::vector< std::string > series = options.series() ? seriesFileNames(seriesPattern, 0, options.size[2] - 1) : std::vector< std::string >();
+
+		start();
+		SyntheticVolumeWriter volumeWriter(options, volumeFile, series);
+		dispatchComponentType(componentType(options.type), volumeWriter);
+		stop("generate");
+
+		tlp::SimplePluginProgress progress;
+
+		tlp::DataSet importParameters = tlp::getDefaultPluginParameters("Import image");
+		importParameters.set("file::File", volumeFile);
+		importParameters.set("Series pattern", seriesPattern);
+		importParameters.set("Series end", (unsigned int)(options.size[2] - 1));
+		setCollection(importParameters, "Property type", options.propertyType);
+		importParameters.set("Threads", options.threads);
+
+		start();
+		tlp::Graph *graph = tlp::importGraph("Import image", importParameters, &progress);
+		if(graph == NULL)
+			throw std::runtime_error("Import image: " + progress.getError());
+		stop("import");
+		addSteps("import", graph);
+
+		try {
+			std::string errorMessage;
+
+			tlp::DataSet loadParameters = tlp::getDefaultPluginParameters("Load image data", graph);
+			loadParameters.set("file::Image", volumeFile);
+			loadParameters.set("Series pattern", seriesPattern);
+			loadParameters.set("Series end", (unsigned int)(options.size[2] - 1));
+			loadParameters.set("Property", graph->getProperty("data"));
+			loadParameters.set("Threads", options.threads);
+
+			start();
+			if(!graph->applyAlgorithm("Load image data", errorMessage, &loadParameters, &progress))
+				throw std::runtime_error("Load image data: " + errorMessage);
+			stop("load");
+			addSteps("load", graph);
+
+			for(unsigned int i = 0; i < options.exportPatterns.size(); ++i) {
+				const std::string &pattern = options.exportPatterns[i];
+
+				// Slice series can only hold colors and booleans, the other properties are
+				// replaced by the colors of the nodes, so that the encoders are still measured.
+				const bool series = !isMetaImageFile(pattern);
+				const std::string property = series && options.propertyType != "Color" && options.propertyType != "Boolean" ? "viewColor" : "data";
+
+				tlp::DataSet exportParameters = tlp::getDefaultPluginParameters("Export image", graph);
+				exportParameters.set("Property", graph->getProperty(property));
+				exportParameters.set("dir::Export directory", options.workDir);
+				exportParameters.set("Export pattern", pattern);
+				exportParameters.set("Encoder threads", options.threads);
+
+				start();
+				if(!graph->applyAlgorithm("Export image", errorMessage, &exportParameters, &progress))
+					throw std::runtime_error("Export image: " + errorMessage);
+				const std::string phase = series ? "export " + pattern + " (" + property + ")" : "export " + pattern;
+				stop(phase);
+				addSteps(phase, graph);
+			}
+		} catch(...) {
+			delete graph;
+			throw;
+		}
+
+		delete graph;
+	}
+
+	void writeJSON(std::ostream &out) const
+	{
+		out << "{" << std::endl
+		    << "  \"volume\": { \"width\": " << options.size[0] << ", \"height\": " << options.size[1] << ", \"depth\": " << options.size[2]
+		    << ", \"components\": " << options.components << ", \"type\": \"" << options.type << "\", \"property_type\": \"" << options.propertyType
+		    << "\", \"input_format\": \"" << options.inputFormat << "\" }," << std::endl
+		    << "  \"threads\": " << options.threads << "," << std::endl
+		    << "  \"phases\": [" << std::endl;
+		for(unsigned int i = 0; i < results.size(); ++i) {
+			const PhaseResult &r = results[i];
+			out << "    { \"name\": \"" << r.name << "\", \"seconds\": " << r.seconds
+			    << ", \"voxels_per_second\": " << (r.seconds > 0 ? r.voxels / r.seconds : 0)
+			    << ", \"peak_rss_kb\": " << r.peakMemory << " }" << (i + 1 < results.size() ? "," : "") << std::endl;
+		}
+		out << "  ]" << std::endl
+		    << "}" << std::endl;
+	}
+
+	void writeCSV(std::ostream &out) const
+	{
+		out << "phase,width,height,depth,components,type,property_type,input_format,threads,seconds,voxels_per_second,peak_rss_kb" << std::endl;
+		for(unsigned int i = 0; i < results.size(); ++i) {
+			const PhaseResult &r = results[i];
+			out << r.name << "," << options.size[0] << "," << options.size[1] << "," << options.size[2] << ","
+			    << options.components << "," << options.type << "," << options.propertyType << "," << options.inputFormat << "," << options.threads << ","
+			    << r.seconds << "," << (r.seconds > 0 ? r.voxels / r.seconds : 0) << "," << r.peakMemory << std::endl;
+		}
+	}
+};
+
+}
+
+int main(int argc, char **argv)
+{
+	try {
+		const Options options = parseArguments(argc, argv);
+
+		tlp::initTulipLib();
+		tlp::PluginLibraryLoader::loadPlugins(NULL, options.pluginsDir);
+
+		Benchmark benchmark(options);
+		benchmark.run();
+
+		std::ofstream file;
+		if(!options.output.empty()) {
+			file.open(options.output.c_str());
+			if(!file)
+				throw std::runtime_error("Unable to write the results to \"" + options.output + "\"");
+		}
+		std::ostream &out = options.output.empty() ? std::cout : file;
+
+		if(options.format == "csv")
+			benchmark.writeCSV(out);
+		else
+			benchmark.writeJSON(out);
+	} catch(std::runtime_error &ex) {
+		std::cerr << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
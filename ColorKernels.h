@@ -0,0 +1,184 @@
+#ifndef COLORKERNELS_H
+#define COLORKERNELS_H
+
+/*
+ * Row kernels converting interleaved gray or RGB samples into tlp::Color values.
+ *
+ * Unsigned char images have vectorized kernels, selected at compile time from
+ * the instruction sets enabled for the compiler (SSE2 is always available on
+ * x86_64; SSSE3 and AVX2 require the IMAGE3D_NATIVE_ARCH CMake option or an
+ * equivalent -m flag). Other component types use the scalar kernels.
+ *
+ * Gray levels computed from RGB samples are (r + g + b) / 3, truncated to
+ * unsigned char.
+ */
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// The vectorized kernels write tlp::Color values as packed RGBA bytes.
+typedef char ColorLayoutCheck[sizeof(tlp::Color) == 4 ? 1 : -1];
+
+template <typename TPixel>
+void grayRowToColor(const TPixel *data_raw, const uint64_t count, tlp::Color *c)
+{
+	for(uint64_t x = 0; x < count; ++x)
+		c[x].set(data_raw[x], data_raw[x], data_raw[x]);
+}
+
+template <typename TPixel>
+void rgbRowToColor(const TPixel *data_raw, const uint64_t count, tlp::Color *c)
+{
+	for(uint64_t x = 0; x < count; ++x, data_raw += 3)
+		c[x].set(data_raw[0], data_raw[1], data_raw[2]);
+}
+
+template <typename TPixel>
+void rgbRowToGrayColor(const TPixel *data_raw, const uint64_t count, tlp::Color *c)
+{
+	for(uint64_t x = 0; x < count; ++x, data_raw += 3) {
+		unsigned char g = (data_raw[0] + data_raw[1] + data_raw[2]) / 3;
+		c[x].set(g, g, g);
+	}
+}
+
+#if defined(__SSE2__)
+inline void grayRowToColorUC(const unsigned char *data_raw, const uint64_t count, tlp::Color *c)
+{
+	uint64_t x = 0;
+	unsigned char *out = reinterpret_cast< unsigned char* >(c);
+
+#if defined(__AVX2__)
+	const __m256i spread = _mm256_set1_epi32(0x00010101);
+	const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+	for(; x + 8 <= count; x += 8) {
+		__m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast< const __m128i* >(data_raw + x)));
+		g = _mm256_or_si256(_mm256_mullo_epi32(g, spread), alpha);
+		_mm256_storeu_si256(reinterpret_cast< __m256i* >(out + 4 * x), g);
+	}
+#else
+	const __m128i alpha = _mm_set1_epi8((char)0xFF);
+	for(; x + 16 <= count; x += 16) {
+		const __m128i g = _mm_loadu_si128(reinterpret_cast< const __m128i* >(data_raw + x));
+		const __m128i gg_lo = _mm_unpacklo_epi8(g, g), gg_hi = _mm_unpackhi_epi8(g, g);
+		const __m128i ga_lo = _mm_unpacklo_epi8(g, alpha), ga_hi = _mm_unpackhi_epi8(g, alpha);
+		_mm_storeu_si128(reinterpret_cast< __m128i* >(out + 4 * x),      _mm_unpacklo_epi16(gg_lo, ga_lo));
+		_mm_storeu_si128(reinterpret_cast< __m128i* >(out + 4 * x + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+		_mm_storeu_si128(reinterpret_cast< __m128i* >(out + 4 * x + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+		_mm_storeu_si128(reinterpret_cast< __m128i* >(out + 4 * x + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+	}
+#endif
+
+	grayRowToColor(data_raw + x, count - x, c + x);
+}
+#endif
+
+#if defined(__SSSE3__)
+inline void rgbRowToColorUC(const unsigned char *data_raw, const uint64_t count, tlp::Color *c)
+{
+	uint64_t x = 0;
+	unsigned char *out = reinterpret_cast< unsigned char* >(c);
+
+	// 16 bytes are loaded to read 4 pixels (12 bytes), the loops stop early
+	// enough to never read past the end of the row.
+#if defined(__AVX2__)
+	const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+	                                         0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+	for(; x + 10 <= count; x += 8) {
+		const __m128i lo = _mm_loadu_si128(reinterpret_cast< const __m128i* >(data_raw + 3 * x));
+		const __m128i hi = _mm_loadu_si128(reinterpret_cast< const __m128i* >(data_raw + 3 * x + 12));
+		const __m256i rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256(reinterpret_cast< __m256i* >(out + 4 * x), _mm256_or_si256(_mm256_shuffle_epi8(rgb, shuffle), alpha));
+	}
+#endif
+
+	const __m128i shuffle4 = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha4 = _mm_set1_epi32(0xFF000000);
+	for(; x + 6 <= count; x += 4) {
+		const __m128i rgb = _mm_loadu_si128(reinterpret_cast< const __m128i* >(data_raw + 3 * x));
+		_mm_storeu_si128(reinterpret_cast< __m128i* >(out + 4 * x), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle4), alpha4));
+	}
+
+	rgbRowToColor(data_raw + 3 * x, count - x, c + x);
+}
+
+inline void rgbRowToGrayColorUC(const unsigned char *data_raw, const uint64_t count, tlp::Color *c)
+{
+	uint64_t x = 0;
+	unsigned char *out = reinterpret_cast< unsigned char* >(c);
+
+	// r0..r3 and g0..g3, then b0..b3, as 16 bits integers.
+	const __m128i rg = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 1, -1, 4, -1, 7, -1, 10, -1);
+	const __m128i b = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, -1, 2, 2, 2, -1, 4, 4, 4, -1, 6, 6, 6, -1);
+	// floor(s / 3) == (s * 0xAAAB) >> 17 for s < 2^16.
+	const __m128i third = _mm_set1_epi16((short)0xAAAB);
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	for(; x + 6 <= count; x += 4) {
+		const __m128i rgb = _mm_loadu_si128(reinterpret_cast< const __m128i* >(data_raw + 3 * x));
+		const __m128i v_rg = _mm_shuffle_epi8(rgb, rg);
+		__m128i sum = _mm_add_epi16(_mm_add_epi16(v_rg, _mm_srli_si128(v_rg, 8)), _mm_shuffle_epi8(rgb, b));
+		sum = _mm_srli_epi16(_mm_mulhi_epu16(sum, third), 1);
+		_mm_storeu_si128(reinterpret_cast< __m128i* >(out + 4 * x), _mm_or_si128(_mm_shuffle_epi8(sum, spread), alpha));
+	}
+
+	rgbRowToGrayColor(data_raw + 3 * x, count - x, c + x);
+}
+#endif
+
+/**
+ * Selects the kernel converting rows of the given kind of pixels.
+ */
+template <typename TPixel>
+struct ColorKernel
+{
+	typedef void (*Type)(const TPixel*, const uint64_t, tlp::Color*);
+
+	static Type select(const unsigned int numberOfComponents, const bool convert_to_grayscale)
+	{
+		if(numberOfComponents == 1)
+			return &grayRowToColor< TPixel >;
+		if(convert_to_grayscale)
+			return &rgbRowToGrayColor< TPixel >;
+		return &rgbRowToColor< TPixel >;
+	}
+};
+
+template <>
+struct ColorKernel< unsigned char >
+{
+	typedef void (*Type)(const unsigned char*, const uint64_t, tlp::Color*);
+
+	static Type select(const unsigned int numberOfComponents, const bool convert_to_grayscale)
+	{
+		if(numberOfComponents == 1) {
+#if defined(__SSE2__)
+			return &grayRowToColorUC;
+#else
+			return &grayRowToColor< unsigned char >;
+#endif
+		}
+
+#if defined(__SSSE3__)
+		if(convert_to_grayscale)
+			return &rgbRowToGrayColorUC;
+		return &rgbRowToColorUC;
+#else
+		if(convert_to_grayscale)
+			return &rgbRowToGrayColor< unsigned char >;
+		return &rgbRowToColor< unsigned char >;
+#endif
+	}
+};
+
+#endif /* COLORKERNELS_H */
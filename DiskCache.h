@@ -0,0 +1,117 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QString>
+
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+
+#include "ImageIOUtils.h"
+#include "MetaImageUtils.h"
+
+/*
+ * Decoded copy of an image, stored next to it as an uncompressed MetaImage
+ * (<image>.cache.mhd and <image>.cache.raw) so that the next imports map it
+ * in memory instead of decoding the image again.
+ *
+ * The values are stored in the component type the image is decoded to, in
+ * the byte order of the host, from the start of the .raw file (so they are
+ * page aligned once mapped). The size and modification time (in ms) of the
+ * image are stored in the header, the cache is rebuilt when they change.
+ */
+
+inline std::string diskCacheFile(const std::string &file)
+{
+	return file + ".cache.mhd";
+}
+
+inline std::string diskCacheStamp(const std::string &file)
+{
+	const QFileInfo info(QString::fromStdString(file));
+	std::ostringstream stamp;
+	stamp << info.size() << " " << info.lastModified().toMSecsSinceEpoch();
+	return stamp.str();
+}
+
+/**
+ * Decodes an image slab by slab into a disk cache. The header is written
+ * last, so an interrupted write never results in a valid cache.
+ */
+class WriteDiskCacheVisitor
+{
+private:
+	const std::string &file;
+	const uint64_t slabDepth;
+
+public:
+	WriteDiskCacheVisitor(const std::string &file, const uint64_t slabDepth) :
+		file(file), slabDepth(slabDepth)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		const std::string headerFile = diskCacheFile(file);
+		const std::string dataFile = file + ".cache.raw";
+		const std::string stamp = diskCacheStamp(file);
+
+		QFile::remove(QString::fromStdString(headerFile));
+
+		QFile data(QString::fromStdString(dataFile));
+		if(!data.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			throw std::runtime_error("Unable to write \"" + dataFile + "\"");
+
+		SlabReader< TPixel > reader(file, slabDepth);
+		const unsigned int numberOfComponents = reader.image()->GetNumberOfComponentsPerPixel();
+		while(reader.next()) {
+			const TPixel *values = reader.image()->GetBufferPointer() + reader.image()->ComputeOffset(reader.region().GetIndex()) * numberOfComponents;
+			const qint64 size = (qint64)reader.region().GetNumberOfPixels() * numberOfComponents * sizeof(TPixel);
+			if(data.write(reinterpret_cast< const char* >(values), size) != size)
+				throw std::runtime_error("Unable to write \"" + dataFile + "\"");
+		}
+		data.close();
+
+		const typename SlabReader< TPixel >::ImageType::SizeType size = reader.image()->GetLargestPossibleRegion().GetSize();
+		const std::string header = formatMetaImageHeader< TPixel >(size[0], size[1], size[2], numberOfComponents,
+		                                                           dataFile.substr(dataFile.find_last_of("/\\") + 1),
+		                                                           "SourceStamp = " + stamp + "\n");
+
+		const QString temporary = QString::fromStdString(headerFile + ".tmp");
+		QFile out(temporary);
+		if(!out.open(QIODevice::WriteOnly | QIODevice::Truncate) || out.write(header.data(), header.size()) != (qint64)header.size())
+			throw std::runtime_error("Unable to write \"" + headerFile + "\"");
+		out.close();
+
+		if(!QFile::rename(temporary, QString::fromStdString(headerFile)))
+			throw std::runtime_error("Unable to write \"" + headerFile + "\"");
+	}
+};
+
+/**
+ * Opens the disk cache of an image, building it first when it does not exist
+ * or is outdated. Returns false when the cache cannot be used (e.g. the
+ * directory of the image is read-only), the image must then be read directly.
+ */
+inline bool openDiskCache(const std::string &file, const ImageInformation &info, const unsigned int streamingMemory, MappableMetaImage &cache)
+{
+	const std::string stamp = diskCacheStamp(file);
+	if(readMappableMetaImage(diskCacheFile(file), cache) && cache.sourceStamp == stamp)
+		return true;
+
+	try {
+		WriteDiskCacheVisitor writer(file, computeSlabDepth(info, streamingMemory));
+		dispatchComponentType(info.componentType, writer);
+	} catch(std::runtime_error &ex) {
+		tlp::warning() << "The disk cache of \"" << file << "\" cannot be used: " << ex.what() << std::endl;
+		return false;
+	}
+
+	return readMappableMetaImage(diskCacheFile(file), cache) && cache.sourceStamp == stamp;
+}
+
+#endif /* DISKCACHE_H */
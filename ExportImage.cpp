@@ -4,24 +4,17 @@
 #include <stdexcept>
 
 #include <itkRGBPixel.h>
-#include <itkImage.h>
-#include <itkImageSeriesWriter.h>
-#include <itkImageRegionIterator.h>
 #include <itkNumericSeriesFileNames.h>
 
 #include <QDir>
 
-#include "GraphFillingFunctions2.h"
+#include "MetaImageUtils.h"
+#include "SliceSeriesWriter.h"
+#include "PhaseStatistics.h"
 
 typedef unsigned char UCPixelType;
 typedef itk::RGBPixel< unsigned char > RGBPixelType;
 
-typedef itk::Image< UCPixelType, 3 > UCImageType;
-typedef itk::Image< RGBPixelType, 3 > RGBImageType;
-
-typedef typename itk::ImageSeriesWriter< UCImageType, itk::Image< UCPixelType, 2 > > UCImageSeriesWriterType;
-typedef typename itk::ImageSeriesWriter< RGBImageType, itk::Image< RGBPixelType, 2 > > RGBImageSeriesWriterType;
-
 using namespace std;
 using namespace tlp;
 
@@ -40,7 +33,8 @@ const char *paramHelp[] = {
 		HTML_HELP_DEF("Type", "Property")
 		HTML_HELP_DEF("Default", "data")
 		HTML_HELP_BODY()
-		"The Property you want to export (Color, Boolean)."
+		"The Property you want to export (Color, Boolean, Integer, Double, IntegerVector, DoubleVector). "
+		"Integer, Double and vector properties can only be exported to MetaImage files (.mha, .mhd)."
 		HTML_HELP_CLOSE(),
 
 	// 1 Export directory
@@ -50,13 +44,116 @@ const char *paramHelp[] = {
 		"Path of the image that will be created."
 		HTML_HELP_CLOSE(),
 
-	// 3 Export pattern
+	// 2 Export pattern
 	HTML_HELP_OPEN()
 		HTML_HELP_DEF("Type", "String")
 		HTML_HELP_BODY()
-		"Name of image that will be created."
+		"Name of image that will be created. MetaImage files (.mha, .mhd) are written as a single 3D image, "
+		"with the property values in their native type (unsigned char, int or double). "
+		"Other formats are written one file per slice, the pattern must then contain an index (e.g. out%03d.bmp) unless the image has a single slice."
+		HTML_HELP_CLOSE(),
+
+	// 3 Encoder threads
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Number of threads encoding the slices while the next ones are filled, or converting the values of a MetaImage file. "
+		"0 uses one thread per core."
+		HTML_HELP_CLOSE(),
+
+	// 4 Statistics log
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"The time, number of voxels and memory of each phase of the export are stored in the image3d_stats graph attribute. "
+		"When true, they are also written to the debug output of Tulip."
 		HTML_HELP_CLOSE()
 };
+
+struct ColorToRGB
+{
+	tlp::ColorProperty *property;
+
+	ColorToRGB(tlp::ColorProperty *property) : property(property) {}
+
+	void operator()(const tlp::node n, RGBPixelType &pixel) const
+	{
+		const tlp::Color &c = property->getNodeValue(n);
+		pixel.SetRed(c.getR());
+		pixel.SetGreen(c.getG());
+		pixel.SetBlue(c.getB());
+	}
+};
+
+struct BooleanToUC
+{
+	tlp::BooleanProperty *property;
+
+	BooleanToUC(tlp::BooleanProperty *property) : property(property) {}
+
+	void operator()(const tlp::node n, UCPixelType &pixel) const
+	{
+		pixel = property->getNodeValue(n) ? 255 : 0;
+	}
+
+	void operator()(const tlp::node n, UCPixelType *values) const
+	{
+		(*this)(n, *values);
+	}
+};
+
+struct ColorToUC
+{
+	tlp::ColorProperty *property;
+
+	ColorToUC(tlp::ColorProperty *property) : property(property) {}
+
+	void operator()(const tlp::node n, UCPixelType *values) const
+	{
+		const tlp::Color &c = property->getNodeValue(n);
+		values[0] = c.getR();
+		values[1] = c.getG();
+		values[2] = c.getB();
+	}
+};
+
+template <typename TPropertyType, typename TValueType>
+struct ScalarToValue
+{
+	TPropertyType *property;
+
+	ScalarToValue(TPropertyType *property) : property(property) {}
+
+	void operator()(const tlp::node n, TValueType *values) const
+	{
+		*values = property->getNodeValue(n);
+	}
+};
+
+/**
+ * Vectors longer than the number of channels are truncated, shorter ones
+ * padded with zeros.
+ */
+template <typename TPropertyType, typename TValueType>
+struct VectorToValues
+{
+	TPropertyType *property;
+	unsigned int numberOfChannels;
+
+	VectorToValues(TPropertyType *property, const unsigned int numberOfChannels) :
+		property(property), numberOfChannels(numberOfChannels)
+	{}
+
+	void operator()(const tlp::node n, TValueType *values) const
+	{
+		const typename TPropertyType::RealType &v = property->getNodeValue(n);
+		const unsigned int size = std::min< unsigned int >(v.size(), numberOfChannels);
+		std::copy(v.begin(), v.begin() + size, values);
+		std::fill(values + size, values + numberOfChannels, TValueType(0));
+	}
+};
 }
 
 class ExportImage: public tlp::Algorithm {
@@ -66,8 +163,10 @@ private:
 	tlp::StringCollection pixel_format;
 
 	int height, width, depth;
+	unsigned int encoder_threads;
+	bool statistics_log;
 
-	enum property_t { COLOR, BOOLEAN };
+	enum property_t { COLOR, BOOLEAN, INTEGER, DOUBLE, INTEGERVECTOR, DOUBLEVECTOR };
 	property_t property_type;
 
 public:
@@ -88,11 +187,88 @@ public:
 	{
 		addInParameter< tlp::PropertyInterface* > ("Property",              paramHelp[0], "data");
 		addInParameter< std::string >             ("dir::Export directory", paramHelp[1], "");
-		addInParameter< std::string >             ("Export pattern",        paramHelp[1], "out.bmp");
+		addInParameter< std::string >             ("Export pattern",        paramHelp[2], "out.bmp");
+		addInParameter< unsigned int >            ("Encoder threads",       paramHelp[3], "0", false);
+		addInParameter< bool >                    ("Statistics log",        paramHelp[4], "false", false);
 	}
 
 	~ExportImage() {}
 
+	/**
+	 * Slices are filled one at a time and encoded in the background, the
+	 * whole image is never allocated.
+	 */
+	void exportSliceSeries(const std::vector< std::string > &files, const VoxelNodeMap &nodes, QThreadPool &pool)
+	{
+		switch(this->property_type) {
+			case COLOR:
+				writeSliceSeries< RGBPixelType >(nodes, width, height, depth, files,
+				                                 ColorToRGB(dynamic_cast< tlp::ColorProperty* >(this->property)), pool, pluginProgress);
+				break;
+			case BOOLEAN:
+				writeSliceSeries< UCPixelType >(nodes, width, height, depth, files,
+				                                BooleanToUC(dynamic_cast< tlp::BooleanProperty* >(this->property)), pool, pluginProgress);
+				break;
+			default:
+				break;
+		}
+	}
+
+	/**
+	 * The values are written straight into the mapped MetaImage data file.
+	 * Vector properties get as many channels as the vector of the first node.
+	 */
+	void exportMetaImage(const std::string &file, const VoxelNodeMap &nodes, QThreadPool &pool)
+	{
+		// First node of the grid, which may not be the first voxel of a sparse grid.
+		tlp::node first;
+		for(uint64_t v = 0; v < nodes.size() && !first.isValid(); ++v)
+			first = nodes[v];
+
+		switch(this->property_type) {
+			case COLOR:
+				writeMetaImage< UCPixelType >(file, nodes, width, height, depth, 3,
+				                              ColorToUC(dynamic_cast< tlp::ColorProperty* >(this->property)), pool, pluginProgress);
+				break;
+			case BOOLEAN:
+				writeMetaImage< UCPixelType >(file, nodes, width, height, depth, 1,
+				                              BooleanToUC(dynamic_cast< tlp::BooleanProperty* >(this->property)), pool, pluginProgress);
+				break;
+			case INTEGER:
+				writeMetaImage< int >(file, nodes, width, height, depth, 1,
+				                      ScalarToValue< tlp::IntegerProperty, int >(dynamic_cast< tlp::IntegerProperty* >(this->property)), pool, pluginProgress);
+				break;
+			case DOUBLE:
+				writeMetaImage< double >(file, nodes, width, height, depth, 1,
+				                         ScalarToValue< tlp::DoubleProperty, double >(dynamic_cast< tlp::DoubleProperty* >(this->property)), pool, pluginProgress);
+				break;
+			case INTEGERVECTOR: {
+				tlp::IntegerVectorProperty *p = dynamic_cast< tlp::IntegerVectorProperty* >(this->property);
+				const unsigned int numberOfChannels = first.isValid() ? std::max< unsigned int >(1, p->getNodeValue(first).size()) : 1;
+				writeMetaImage< int >(file, nodes, width, height, depth, numberOfChannels,
+				                      VectorToValues< tlp::IntegerVectorProperty, int >(p, numberOfChannels), pool, pluginProgress);
+			} break;
+			case DOUBLEVECTOR: {
+				tlp::DoubleVectorProperty *p = dynamic_cast< tlp::DoubleVectorProperty* >(this->property);
+				const unsigned int numberOfChannels = first.isValid() ? std::max< unsigned int >(1, p->getNodeValue(first).size()) : 1;
+				writeMetaImage< double >(file, nodes, width, height, depth, numberOfChannels,
+				                         VectorToValues< tlp::DoubleVectorProperty, double >(p, numberOfChannels), pool, pluginProgress);
+			} break;
+		}
+	}
+
+	void removeExportedFiles(const std::string &out, const std::vector< std::string > &slices)
+	{
+		if(isMetaImageFile(out)) {
+			QFile::remove(QString::fromStdString(out));
+			if(hasSuffix(out, ".mhd"))
+				QFile::remove(QString::fromStdString(out.substr(0, out.size() - 4) + ".raw"));
+		} else {
+			for(uint64_t i = 0; i < slices.size(); ++i)
+				QFile::remove(QString::fromStdString(slices[i]));
+		}
+	}
+
 	bool check(std::string &err) {
 		try {
 			if(dataSet == NULL)
@@ -102,8 +278,13 @@ public:
 			CHECK_PROP_PROVIDED("dir::Export directory", export_dir);
 			CHECK_PROP_PROVIDED("Export pattern", export_pattern);
 
-			if(!(graph->getAttribute<int>("width", this->width) && graph->getAttribute<int>("height", this->height) && graph->getAttribute<int>("depth", this->depth)))
-				throw std::runtime_error("Unable to get the image dimensions from the graph. Make sure it has been created by the \"Image 3D\" import plugin");
+			this->encoder_threads = 0;
+			dataSet->get("Encoder threads", this->encoder_threads);
+
+			this->statistics_log = false;
+			dataSet->get("Statistics log", this->statistics_log);
+
+			getGridDimensions(graph, this->width, this->height, this->depth);
 
 			if(export_dir.empty()) {
 				std::stringstream e; e << "The \"dir::Export directory\" parameter cannot be empty";
@@ -119,11 +300,31 @@ public:
 				this->property_type = COLOR;
 			} else if (dynamic_cast< tlp::BooleanProperty* >(this->property)) {
 				this->property_type = BOOLEAN;
+			} else if (dynamic_cast< tlp::IntegerProperty* >(this->property)) {
+				this->property_type = INTEGER;
+			} else if (dynamic_cast< tlp::DoubleProperty* >(this->property)) {
+				this->property_type = DOUBLE;
+			} else if (dynamic_cast< tlp::IntegerVectorProperty* >(this->property)) {
+				this->property_type = INTEGERVECTOR;
+			} else if (dynamic_cast< tlp::DoubleVectorProperty* >(this->property)) {
+				this->property_type = DOUBLEVECTOR;
 			} else {
 				throw std::runtime_error("\"Property\" must be a property of one of the following types: "
-				                         "ColorProperty, BooleanProperty.");
+				                         "ColorProperty, BooleanProperty, IntegerProperty, DoubleProperty, IntegerVectorProperty, DoubleVectorProperty.");
 			}
 
+			if(this->property_type != COLOR && this->property_type != BOOLEAN && !isMetaImageFile(export_pattern))
+				throw std::runtime_error("Integer, Double and vector properties can only be exported to MetaImage files (.mha, .mhd).");
+
+			// The pattern is formatted with the index of each slice.
+			const int indexes = countSliceIndexes(export_pattern);
+			if(indexes < 0 || indexes > 1)
+				throw std::runtime_error("The \"Export pattern\" parameter can only contain a single integer conversion (e.g. %03d), as the index of the slices.");
+
+			// The slices are encoded concurrently, they must not share a file.
+			if(!isMetaImageFile(export_pattern) && this->depth > 1 && indexes == 0)
+				throw std::runtime_error("The \"Export pattern\" parameter must contain an index (e.g. out%03d.bmp) to export the slices of the image to different files.");
+
 		} catch (std::runtime_error &ex) {
 			err.assign(ex.what());
 			return false;
@@ -135,8 +336,13 @@ public:
 	bool run()
 	{
 		try {
-			const unsigned int numberOfPixels = this->width * this->height * this->depth;
-			int i = 0;
+			PhaseStatistics statistics;
+			statistics.start("index");
+
+			VoxelNodeMap nodes(graph);
+			if(nodes.size() != (uint64_t)this->width * this->height * this->depth)
+				throw std::runtime_error("The number of nodes of the graph does not match the size of the image");
+
 			std::string out = QDir(QString(export_dir.c_str())).filePath(export_pattern.c_str()).toStdString();
 			itk::NumericSeriesFileNames::Pointer filenameGenerator = itk::NumericSeriesFileNames::New();
 			filenameGenerator->SetStartIndex(0);
@@ -144,83 +350,29 @@ public:
 			filenameGenerator->SetIncrementIndex(1);
 			filenameGenerator->SetSeriesFormat(out);
 
-			switch(this->property_type) {
-				case COLOR: {
-					RGBImageType::Pointer image = RGBImageType::New();
-
-					RGBImageType::IndexType origin = {{0, 0, 0}};
-					RGBImageType::SizeType size;
-					size[0] = width; size[1] = height; size[2] = depth;
-
-					RGBImageType::RegionType region(origin, size);
-					image->SetRegions(region);
-					image->Allocate();
-
-					tlp::ColorProperty *prop = dynamic_cast< tlp::ColorProperty* >(this->property);
-					itk::ImageRegionIterator< RGBImageType > iterator(image, image->GetLargestPossibleRegion());
-					tlp::node n;
-					forEach(n, graph->getNodes())
-					{
-						tlp::Color gc = prop->getNodeValue(n);
-						RGBPixelType pix;
-						pix.SetRed(gc.getR());
-						pix.SetGreen(gc.getG());
-						pix.SetBlue(gc.getB());
-
-						iterator.Set(pix);
-
-						++i;
-						++iterator;
-
-						reportProgress(pluginProgress, i, numberOfPixels);
-					}
-
-					try {
-						typename RGBImageSeriesWriterType::Pointer writer = RGBImageSeriesWriterType::New();
-						writer->SetInput(image);
-						writer->SetFileNames(filenameGenerator->GetFileNames());
-						writer->Update();
-					} catch ( itk::ExceptionObject & err ) {
-						std::stringstream e; e << "The image cannot be exported: " << err.GetDescription();
-						throw std::runtime_error(e.str());
-					}
-				} break;
-				case BOOLEAN: {
-					  UCImageType::Pointer image = UCImageType::New();
-
-					UCImageType::IndexType origin = {{0, 0, 0}};
-					UCImageType::SizeType size;
-					size[0] = width; size[1] = height; size[2] = depth;
-
-					UCImageType::RegionType region(origin, size);
-					image->SetRegions(region);
-					image->Allocate();
-
-					tlp::BooleanProperty *prop = dynamic_cast< tlp::BooleanProperty* >(this->property);
-					itk::ImageRegionIterator< UCImageType > iterator(image, image->GetLargestPossibleRegion());
-					tlp::node n;
-					forEach(n, graph->getNodes())
-					{
-						iterator.Set(prop->getNodeValue(n) ? 255 : 0);
-
-						++i;
-						++iterator;
-
-						reportProgress(pluginProgress, i, numberOfPixels);
-					}
-
-					try {
-						typename UCImageSeriesWriterType::Pointer writer = UCImageSeriesWriterType::New();
-						writer->SetInput(image);
-						writer->SetFileNames(filenameGenerator->GetFileNames());
-						writer->Update();
-					} catch ( itk::ExceptionObject & err ) {
-						std::stringstream e; e << "The image cannot be exported: " << err.GetDescription();
-						throw std::runtime_error(e.str());
-					}
-				} break;
+			QThreadPool pool;
+			pool.setMaxThreadCount(threadCount(this->encoder_threads));
+
+			statistics.stop(graph->numberOfNodes());
+			statistics.start("write");
+
+			// Stopping keeps the slices written so far (the others are 0 in a MetaImage
+			// file), cancelling removes the files.
+			try {
+				if(isMetaImageFile(out))
+					exportMetaImage(out, nodes, pool);
+				else
+					exportSliceSeries(filenameGenerator->GetFileNames(), nodes, pool);
+			} catch(ProgressInterruption &ex) {
+				if(ex.state != tlp::TLP_STOP) {
+					removeExportedFiles(out, filenameGenerator->GetFileNames());
+					throw;
+				}
 			}
 
+			statistics.stop(nodes.size());
+			statistics.store(graph, PLUGIN_NAME, this->statistics_log);
+
 		} catch(std::runtime_error &ex) {
 			if(pluginProgress)
 				pluginProgress->setError(ex.what());
@@ -1,132 +1,768 @@
 #ifndef GRAPHFILLINGFUNCTIONS2_H
 #define GRAPHFILLINGFUNCTIONS2_H
 
-#include <itkImageRegionConstIterator.h>
+#include <itkVectorImage.h>
+#include <itkTimeProbe.h>
+#include <algorithm>
+#include <sstream>
+#include <stdint.h>
 #include <vector>
 
-void reportProgress(tlp::PluginProgress *pluginProgress, unsigned int step, unsigned int max)
+#include "ColorKernels.h"
+#include "ImageIOUtils.h"
+#include "ImageSampling.h"
+#include "IntensityMapping.h"
+#include "MetaImageUtils.h"
+#include "ProgressUtils.h"
+#include "ThreadPoolUtils.h"
+#include "VoxelNodeMap.h"
+#include "VoxelStatistics.h"
+
+/*
+ * The import functions below fill the nodes mapped to the pixels of the given
+ * region of the image. The region can be a Z-slab of the image. Only the
+ * pixels kept by the sampling of the options are read, each one being mapped
+ * to a node of the sampling grid.
+ *
+ * The region is processed in batches of lines (along Z, or along Y for 2D
+ * images). The pixels of a batch are read row by row straight from the image
+ * buffer and converted in parallel, each thread converting a contiguous range
+ * of lines. The converted values are then written to the property in raster
+ * order from the calling thread, as a Tulip property cannot be written
+ * concurrently. The result does not depend on the number of threads.
+ *
+ * When the nodes of the grid have contiguous ids, each row is written in one
+ * call to the commitRange() of the importer, which calls the setter of the
+ * actual property type directly (Tulip 4 has no setter for a range of nodes
+ * with distinct values, setAllNodeValue() only assigns a single one). The
+ * nodes of a sparse map are written one at a time, through commit().
+ */
+
+/**
+ * Approximate number of pixels converted per batch.
+ */
+static const uint64_t FILL_BATCH_SIZE = 1 << 22;
+
+template <typename TPixel>
+class ColorImporter
 {
-	if(pluginProgress && (step % 10 == 0))
-		pluginProgress->progress(step, max);
-}
+private:
+	tlp::ColorProperty *property;
+	// Selected once for the whole image.
+	typename ColorKernel< TPixel >::Type kernel;
+	const unsigned int numberOfComponents;
+	const bool convert_to_grayscale;
+	// When not NULL, maps the samples through an intensity window.
+	const IntensityMapper< TPixel > *mapper;
 
-template <typename TVectorImageType>
-void importColor(TVectorImageType *image, tlp::Graph *graph, tlp::ColorProperty *property, const bool convert_to_grayscale, tlp::PluginProgress *pluginProgress = NULL)
-{
-	const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
-
-	if(numberOfComponents != 3 && numberOfComponents != 1)
-		throw std::runtime_error("The image must have either 1 or 3 components per pixel.");
-
-	const typename TVectorImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
-	const unsigned int numberOfPixels = imageSize[0] * imageSize[1] * imageSize[2];
-	const typename TVectorImageType::InternalPixelType *data_raw;
-	tlp::Color c;
-	tlp::node n;
-	int i = 0;
-
-	itk::ImageRegionConstIterator< TVectorImageType > iterator(image, image->GetLargestPossibleRegion());
-	forEach(n, graph->getNodes())
-	{
-		data_raw = iterator.Get().GetDataPointer();
-		if(numberOfComponents == 1) {
-			c.set(data_raw[0], data_raw[0], data_raw[0]);
-		} else if(convert_to_grayscale) {
-			unsigned char g = (data_raw[0] + data_raw[1] + data_raw[2]) / 3;
-			c.set(g, g, g);
-		} else {
-			c.set(data_raw[0], data_raw[1], data_raw[2]);
+public:
+	typedef tlp::Color ValueType;
+
+	ColorImporter(tlp::ColorProperty *property, const unsigned int numberOfComponents, const bool convert_to_grayscale, const IntensityMapper< TPixel > *mapper = NULL) :
+		property(property), numberOfComponents(numberOfComponents), convert_to_grayscale(convert_to_grayscale), mapper(mapper)
+	{
+		if(numberOfComponents != 3 && numberOfComponents != 1)
+			throw std::runtime_error("The image must have either 1 or 3 components per pixel.");
+
+		kernel = ColorKernel< TPixel >::select(numberOfComponents, convert_to_grayscale);
+	}
+
+	unsigned int valuesPerPixel() const { return 1; }
+
+	void convertRow(const TPixel *data_raw, const uint64_t count, ValueType *c) const
+	{
+		if(mapper == NULL) {
+			kernel(data_raw, count, c);
+			return;
 		}
-		property->setNodeValue(n, c);
 
-		++i;
-		reportProgress(pluginProgress, i, numberOfPixels);
+		// Each sample goes through the intensity window, the gray level is the mean of the mapped samples.
+		const IntensityMapper< TPixel > &map = *mapper;
+		for(uint64_t x = 0; x < count; ++x, data_raw += numberOfComponents) {
+			if(numberOfComponents == 1) {
+				const unsigned char g = map(data_raw[0]);
+				c[x].set(g, g, g);
+			} else if(convert_to_grayscale) {
+				const unsigned char g = (map(data_raw[0]) + map(data_raw[1]) + map(data_raw[2])) / 3;
+				c[x].set(g, g, g);
+			} else {
+				c[x].set(map(data_raw[0]), map(data_raw[1]), map(data_raw[2]));
+			}
+		}
+	}
 
-		++iterator;
+	void commit(const tlp::node n, const ValueType *c) const
+	{
+		property->setNodeValue(n, *c);
 	}
-}
 
-template <typename TVectorImageType, typename TPropertyType, typename TValueType>
-void importData(TVectorImageType *image, tlp::Graph *graph, TPropertyType *property, tlp::PluginProgress *pluginProgress = NULL)
+	void commitRange(const tlp::node first, const ValueType *c, const uint64_t count) const
+	{
+		for(uint64_t i = 0; i < count; ++i)
+			property->tlp::ColorProperty::setNodeValue(tlp::node(first.id + i), c[i]);
+	}
+};
+
+template <typename TPixel, typename TPropertyType, typename TValueType>
+class DataImporter
 {
-	const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+private:
+	TPropertyType *property;
+	const unsigned int numberOfComponents;
+	const IntensityMapper< TPixel > *mapper;
+
+public:
+	typedef TValueType ValueType;
 
-	/* See ITK/BMP bug
-	if(1 != numberOfComponents)
-		throw std::runtime_error("The image must have either 1 component per pixel.");
-	*/
+	/**
+	 * The mapper, if not NULL, maps the values to [0, 255].
+	 */
+	DataImporter(TPropertyType *property, const unsigned int numberOfComponents, const IntensityMapper< TPixel > *mapper = NULL) :
+		property(property), numberOfComponents(numberOfComponents), mapper(mapper)
+	{
+		/* See ITK/BMP bug
+		if(1 != numberOfComponents)
+			throw std::runtime_error("The image must have either 1 component per pixel.");
+		*/
+	}
 
-	const typename TVectorImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
-	const unsigned int numberOfPixels = imageSize[0] * imageSize[1] * imageSize[2];
-	const typename TVectorImageType::InternalPixelType *data_raw;
-	tlp::node n;
-	int i = 0;
+	unsigned int valuesPerPixel() const { return 1; }
 
-	itk::ImageRegionConstIterator< TVectorImageType > iterator(image, image->GetLargestPossibleRegion());
-	forEach(n, graph->getNodes())
+	void convertRow(const TPixel *data_raw, const uint64_t count, ValueType *value) const
 	{
-		data_raw = iterator.Get().GetDataPointer();
-		property->setNodeValue(n, (TValueType)(data_raw[0]));
+		if(mapper != NULL) {
+			const IntensityMapper< TPixel > &map = *mapper;
+			for(uint64_t x = 0; x < count; ++x, data_raw += numberOfComponents)
+				value[x] = map(data_raw[0]);
+			return;
+		}
 
-		++i;
-		reportProgress(pluginProgress, i, numberOfPixels);
+		for(uint64_t x = 0; x < count; ++x, data_raw += numberOfComponents)
+			value[x] = (TValueType)(data_raw[0]);
+	}
 
-		++iterator;
+	void commit(const tlp::node n, const ValueType *value) const
+	{
+		property->setNodeValue(n, *value);
 	}
-}
 
-template <typename TVectorImageType, typename TPropertyType, typename TValueType>
-void importVectorData(TVectorImageType *image, tlp::Graph *graph, TPropertyType *property, tlp::PluginProgress *pluginProgress = NULL)
+	void commitRange(const tlp::node first, const ValueType *value, const uint64_t count) const
+	{
+		for(uint64_t i = 0; i < count; ++i)
+			property->TPropertyType::setNodeValue(tlp::node(first.id + i), value[i]);
+	}
+};
+
+template <typename TPixel, typename TPropertyType, typename TValueType>
+class VectorDataImporter
 {
-	const typename TVectorImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
+private:
+	TPropertyType *property;
+	const unsigned int numberOfComponents;
+	mutable std::vector< TValueType > data;
+
+public:
+	typedef TValueType ValueType;
+
+	VectorDataImporter(TPropertyType *property, const unsigned int numberOfComponents) :
+		property(property), numberOfComponents(numberOfComponents), data(numberOfComponents)
+	{}
 
-	const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
-	const unsigned int numberOfPixels = imageSize[0] * imageSize[1] * imageSize[2];
-	const typename TVectorImageType::InternalPixelType *data_raw;
-	std::vector< TValueType > data(numberOfComponents);
-	tlp::node n;
-	int i = 0;
+	unsigned int valuesPerPixel() const { return numberOfComponents; }
+
+	void convertRow(const TPixel *data_raw, const uint64_t count, ValueType *value) const
+	{
+		const uint64_t n = count * numberOfComponents;
+		for(uint64_t j = 0; j < n; ++j)
+			value[j] = (TValueType)(data_raw[j]);
+	}
 
-	itk::ImageRegionConstIterator< TVectorImageType > iterator(image, image->GetLargestPossibleRegion());
-	forEach(n, graph->getNodes())
+	void commit(const tlp::node n, const ValueType *value) const
 	{
-		data_raw = iterator.Get().GetDataPointer();
-		for(int j = 0; j < numberOfComponents; ++j)
-			data[j] = (TValueType)(data_raw[j]);
+		// The scratch vector is reused, only the property allocates its own copy.
+		std::copy(value, value + numberOfComponents, data.begin());
 		property->setNodeValue(n, data);
+	}
+
+	void commitRange(const tlp::node first, const ValueType *value, const uint64_t count) const
+	{
+		for(uint64_t i = 0; i < count; ++i, value += numberOfComponents) {
+			std::copy(value, value + numberOfComponents, data.begin());
+			property->TPropertyType::setNodeValue(tlp::node(first.id + i), data);
+		}
+	}
+};
+
+/**
+ * Stores each component of the image in its own scalar property, which avoids
+ * the per node allocations of the vector properties.
+ */
+template <typename TPixel, typename TPropertyType, typename TValueType>
+class ComponentsImporter
+{
+private:
+	const std::vector< TPropertyType* > properties;
+	const unsigned int numberOfComponents;
+
+public:
+	typedef TValueType ValueType;
+
+	ComponentsImporter(const std::vector< TPropertyType* > &properties, const unsigned int numberOfComponents) :
+		properties(properties), numberOfComponents(numberOfComponents)
+	{
+		if(properties.size() != numberOfComponents)
+			throw std::runtime_error("The number of properties does not match the number of components of the image.");
+	}
 
-		++i;
-		reportProgress(pluginProgress, i, numberOfPixels);
+	unsigned int valuesPerPixel() const { return numberOfComponents; }
 
-		++iterator;
+	void convertRow(const TPixel *data_raw, const uint64_t count, ValueType *value) const
+	{
+		const uint64_t n = count * numberOfComponents;
+		for(uint64_t j = 0; j < n; ++j)
+			value[j] = (TValueType)(data_raw[j]);
+	}
+
+	void commit(const tlp::node n, const ValueType *value) const
+	{
+		for(unsigned int j = 0; j < numberOfComponents; ++j)
+			properties[j]->setNodeValue(n, value[j]);
+	}
+
+	// One property at a time, so that each one is written in increasing id order.
+	void commitRange(const tlp::node first, const ValueType *value, const uint64_t count) const
+	{
+		for(unsigned int j = 0; j < numberOfComponents; ++j) {
+			TPropertyType *property = properties[j];
+			for(uint64_t i = 0; i < count; ++i)
+				property->TPropertyType::setNodeValue(tlp::node(first.id + i), value[i * numberOfComponents + j]);
+		}
+	}
+};
+
+template <typename TPixel>
+class SelectionImporter
+{
+private:
+	tlp::BooleanProperty *property;
+
+public:
+	// Not bool, as threads cannot write concurrently in a std::vector< bool >.
+	typedef unsigned char ValueType;
+
+	SelectionImporter(tlp::BooleanProperty *property, const unsigned int numberOfComponents) :
+		property(property)
+	{
+		if(1 != numberOfComponents)
+			throw std::runtime_error("The image must have either 1 component per pixel.");
+	}
+
+	unsigned int valuesPerPixel() const { return 1; }
+
+	void convertRow(const TPixel *data_raw, const uint64_t count, ValueType *value) const
+	{
+		for(uint64_t x = 0; x < count; ++x)
+			value[x] = data_raw[x] > 0;
+	}
+
+	void commit(const tlp::node n, const ValueType *value) const
+	{
+		property->setNodeValue(n, *value != 0);
+	}
+
+	void commitRange(const tlp::node first, const ValueType *value, const uint64_t count) const
+	{
+		for(uint64_t i = 0; i < count; ++i)
+			property->tlp::BooleanProperty::setNodeValue(tlp::node(first.id + i), value[i] != 0);
+	}
+};
+
+/**
+ * Converts the pixels of a range of lines of a batch.
+ */
+template <typename TVectorImageType, typename TImporter>
+class ConvertTask
+{
+private:
+	const TVectorImageType *image;
+	const SampledRegion &batch;
+	const unsigned int axis;
+	const uint64_t lineSize;
+	const TImporter &importer;
+	typename TImporter::ValueType *values;
+	// When not NULL, the values of the voxels having a node are accumulated in the same pass.
+	VoxelStatistics *statistics;
+	const VoxelNodeMap &nodes;
+	const ImageSampling &sampling;
+
+	typedef typename TVectorImageType::InternalPixelType PixelType;
+
+	/**
+	 * Accumulates the pixels of a row whose first pixel is the given voxel of
+	 * the grid, skipping the voxels without a node.
+	 */
+	void accumulate(StatisticsAccumulator< PixelType > &accumulator, const PixelType *row, const uint64_t rowSize, const uint64_t pixelStep, const uint64_t voxel) const
+	{
+		if(nodes.isContiguous()) {
+			accumulator.add(row, rowSize, pixelStep);
+			return;
+		}
+
+		for(uint64_t x = 0; x < rowSize; ++x, row += pixelStep) {
+			if(nodes[voxel + x].isValid())
+				accumulator.add(row, 1, pixelStep);
+		}
+	}
+
+public:
+	ConvertTask(const TVectorImageType *image, const SampledRegion &batch, const unsigned int axis, const uint64_t lineSize, const TImporter &importer, typename TImporter::ValueType *values,
+	            VoxelStatistics *statistics, const VoxelNodeMap &nodes, const ImageSampling &sampling) :
+		image(image), batch(batch), axis(axis), lineSize(lineSize), importer(importer), values(values), statistics(statistics), nodes(nodes), sampling(sampling)
+	{}
+
+	void operator()(const uint64_t begin, const uint64_t end) const
+	{
+		SampledRegion lines = batch;
+		lines.start[axis] += begin * batch.stride[axis];
+		lines.count[axis] = end - begin;
+
+		const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+		const typename TVectorImageType::InternalPixelType *buffer = image->GetBufferPointer();
+		const uint64_t rowSize = lines.count[0];
+		const uint64_t pixelStep = lines.stride[0] * numberOfComponents;
+
+		typename TImporter::ValueType *value = values + begin * lineSize * importer.valuesPerPixel();
+		typename TVectorImageType::IndexType index;
+		index[0] = lines.start[0];
+
+		const bool accumulating = statistics != NULL;
+		StatisticsAccumulator< PixelType > accumulator = accumulating ? StatisticsAccumulator< PixelType >(*statistics, numberOfComponents) : StatisticsAccumulator< PixelType >();
+		const uint64_t gridWidth = sampling.gridSize(0), gridSliceSize = gridWidth * sampling.gridSize(1);
+		const uint64_t gx = (lines.start[0] - sampling.index[0]) / sampling.stride[0];
+
+		for(uint64_t z = 0; z < lines.count[2]; ++z) {
+			index[2] = lines.start[2] + z * lines.stride[2];
+			for(uint64_t y = 0; y < lines.count[1]; ++y) {
+				index[1] = lines.start[1] + y * lines.stride[1];
+				const typename TVectorImageType::InternalPixelType *row = buffer + image->ComputeOffset(index) * numberOfComponents;
+				if(accumulating) {
+					const uint64_t gy = (index[1] - sampling.index[1]) / sampling.stride[1], gz = (index[2] - sampling.index[2]) / sampling.stride[2];
+					accumulate(accumulator, row, rowSize, pixelStep, gx + gy * gridWidth + gz * gridSliceSize);
+				}
+
+				if(lines.stride[0] == 1) {
+					importer.convertRow(row, rowSize, value);
+					value += rowSize * importer.valuesPerPixel();
+				} else {
+					for(uint64_t x = 0; x < rowSize; ++x, row += pixelStep, value += importer.valuesPerPixel())
+						importer.convertRow(row, 1, value);
+				}
+			}
+		}
+
+		if(accumulating)
+			accumulator.mergeInto(*statistics);
+	}
+};
+
+/**
+ * Options of the fill functions.
+ */
+struct FillOptions
+{
+	bool convert_to_grayscale;
+	unsigned int threads;
+	// When not NULL, the nodes are also positioned on the grid, "spacing" apart.
+	tlp::LayoutProperty *layout;
+	double spacing;
+	// Part of the image mapped to the nodes, the whole image by default.
+	ImageSampling sampling;
+	// When not NULL, the statistics of the loaded values are accumulated while filling.
+	VoxelStatistics *statistics;
+	// Applied to the values loaded into Color and Integer properties.
+	IntensityWindow window;
+
+	FillOptions() :
+		convert_to_grayscale(false), threads(0), layout(NULL), spacing(1.0), statistics(NULL)
+	{}
+};
+
+/**
+ * State shared by the fill functions while filling the graph. The node map
+ * and the thread pool can be shared by several fills of the same graph.
+ */
+struct FillContext
+{
+	const VoxelNodeMap &nodes;
+	const FillOptions &options;
+	QThreadPool &pool;
+	tlp::PluginProgress *pluginProgress;
+	// Shared by the slabs (or slices) of an image, so that the reports are throttled across them.
+	ProgressReporter progress;
+	// Time spent waiting for the decoded pixels, interleaved with the filling.
+	itk::TimeProbe decoding;
+
+private:
+	IntensityMapperBase *mapper;
+
+	FillContext(const FillContext &);
+	FillContext& operator=(const FillContext &);
+
+public:
+	FillContext(const VoxelNodeMap &nodes, const FillOptions &options, QThreadPool &pool, tlp::PluginProgress *pluginProgress) :
+		nodes(nodes), options(options), pool(pool), pluginProgress(pluginProgress), progress(pluginProgress), mapper(NULL)
+	{}
+
+	~FillContext()
+	{
+		delete mapper;
+	}
+
+	/**
+	 * Mapper of the intensity window of the options, NULL when it is disabled.
+	 * Built on the first call for a pixel type and kept for the following
+	 * slabs (or slices), as its lookup table is costly to build.
+	 */
+	template <typename TPixel>
+	const IntensityMapper< TPixel >* intensityMapper()
+	{
+		if(!options.window.enabled)
+			return NULL;
+
+		IntensityMapper< TPixel > *typed = dynamic_cast< IntensityMapper< TPixel >* >(mapper);
+		if(typed == NULL) {
+			delete mapper;
+			mapper = typed = new IntensityMapper< TPixel >(options.window);
+		}
+		return typed;
+	}
+
+	/**
+	 * Reads the next slab of a slab reader, measuring the decoding time.
+	 */
+	template <typename TReader>
+	bool readNext(TReader &reader)
+	{
+		decoding.Start();
+		const bool read = reader.next();
+		decoding.Stop();
+		return read;
+	}
+};
+
+template <typename TVectorImageType, typename TImporter>
+void importRegion(TVectorImageType *image, const typename TVectorImageType::RegionType &region, const TImporter &importer, FillContext &context)
+{
+	typedef typename TImporter::ValueType ValueType;
+
+	const typename TVectorImageType::SizeType largestSize = image->GetLargestPossibleRegion().GetSize();
+	const uint64_t imageSize[3] = { largestSize[0], largestSize[1], largestSize[2] };
+	const ImageSampling sampling = resolveSampling(context.options.sampling, imageSize);
+
+	const SampledRegion sampled = sampledRegion(sampling, region);
+	if(sampled.numberOfPixels() == 0)
+		return;
+
+	const uint64_t numberOfNodes = sampling.numberOfSamples();
+	const uint64_t gridWidth = sampling.gridSize(0);
+	const uint64_t gridSliceSize = gridWidth * sampling.gridSize(1);
+
+	const unsigned int axis = sampled.count[2] > 1 ? 2 : 1;
+	const uint64_t numberOfLines = sampled.count[axis];
+	const uint64_t lineSize = sampled.numberOfPixels() / numberOfLines;
+	const uint64_t linesPerBatch = std::min(numberOfLines, std::max< uint64_t >(context.pool.maxThreadCount(), FILL_BATCH_SIZE / lineSize));
+
+	tlp::LayoutProperty *layout = context.options.layout;
+	const float spacing = context.options.spacing;
+	const bool contiguous = context.nodes.isContiguous();
+
+	std::vector< ValueType > values(linesPerBatch * lineSize * importer.valuesPerPixel());
+
+	for(uint64_t line = 0; line < numberOfLines; line += linesPerBatch)
+	{
+		uint64_t done = 0;
+		SampledRegion batch = sampled;
+		batch.start[axis] += line * sampled.stride[axis];
+		batch.count[axis] = std::min(linesPerBatch, numberOfLines - line);
+
+		parallelFor(context.pool, 0, batch.count[axis], ConvertTask< TVectorImageType, TImporter >(image, batch, axis, lineSize, importer, &values[0],
+		                                                                                       context.options.statistics, context.nodes, sampling));
+
+		const ValueType *value = &values[0];
+		for(uint64_t z = 0; z < batch.count[2]; ++z) {
+			const uint64_t gz = (batch.start[2] - sampling.index[2]) / sampling.stride[2] + z;
+			for(uint64_t y = 0; y < batch.count[1]; ++y) {
+				const uint64_t gy = (batch.start[1] - sampling.index[1]) / sampling.stride[1] + y;
+				const uint64_t gx = (batch.start[0] - sampling.index[0]) / sampling.stride[0];
+				const uint64_t voxel = gx + gy * gridWidth + gz * gridSliceSize;
+				done = voxel + batch.count[0];
+
+				if(contiguous) {
+					importer.commitRange(context.nodes[voxel], value, batch.count[0]);
+					if(layout) {
+						for(uint64_t x = 0; x < batch.count[0]; ++x)
+							layout->setNodeValue(context.nodes[voxel + x], tlp::Coord((gx + x) * sampling.stride[0] * spacing, gy * sampling.stride[1] * spacing, gz * sampling.stride[2] * spacing));
+					}
+					value += batch.count[0] * importer.valuesPerPixel();
+					continue;
+				}
+
+				for(uint64_t x = 0; x < batch.count[0]; ++x, value += importer.valuesPerPixel()) {
+					// Voxels left out of a sparse grid have no node.
+					const tlp::node n = context.nodes[voxel + x];
+					if(!n.isValid())
+						continue;
+
+					importer.commit(n, value);
+					// Positioned as in the image, relatively to the origin of the region.
+					if(layout)
+						layout->setNodeValue(n, tlp::Coord((gx + x) * sampling.stride[0] * spacing, gy * sampling.stride[1] * spacing, gz * sampling.stride[2] * spacing));
+				}
+			}
+		}
+
+		// The batch is fully loaded, the user can stop here.
+		context.progress.update(done, numberOfNodes);
+	}
+}
+
+template <typename TVectorImageType>
+void importColor(TVectorImageType *image, const typename TVectorImageType::RegionType &region, tlp::ColorProperty *property, FillContext &context)
+{
+	typedef typename TVectorImageType::InternalPixelType PixelType;
+	ColorImporter< PixelType > importer(property, image->GetNumberOfComponentsPerPixel(), context.options.convert_to_grayscale, context.intensityMapper< PixelType >());
+	importRegion(image, region, importer, context);
+}
+
+template <typename TVectorImageType, typename TPropertyType, typename TValueType>
+void importData(TVectorImageType *image, const typename TVectorImageType::RegionType &region, TPropertyType *property, FillContext &context,
+                const bool mapIntensity = false)
+{
+	typedef typename TVectorImageType::InternalPixelType PixelType;
+	DataImporter< PixelType, TPropertyType, TValueType > importer(property, image->GetNumberOfComponentsPerPixel(), mapIntensity ? context.intensityMapper< PixelType >() : NULL);
+	importRegion(image, region, importer, context);
+}
+
+template <typename TVectorImageType, typename TPropertyType, typename TValueType>
+void importVectorData(TVectorImageType *image, const typename TVectorImageType::RegionType &region, TPropertyType *property, FillContext &context)
+{
+	VectorDataImporter< typename TVectorImageType::InternalPixelType, TPropertyType, TValueType > importer(property, image->GetNumberOfComponentsPerPixel());
+	importRegion(image, region, importer, context);
+}
+
+template <typename TVectorImageType>
+void importSelection(TVectorImageType *image, const typename TVectorImageType::RegionType &region, tlp::BooleanProperty *property, FillContext &context)
+{
+	SelectionImporter< typename TVectorImageType::InternalPixelType > importer(property, image->GetNumberOfComponentsPerPixel());
+	importRegion(image, region, importer, context);
+}
+
+template <typename TVectorImageType, typename TPropertyType, typename TValueType>
+void importComponents(TVectorImageType *image, const typename TVectorImageType::RegionType &region, const std::vector< TPropertyType* > &properties, FillContext &context)
+{
+	ComponentsImporter< typename TVectorImageType::InternalPixelType, TPropertyType, TValueType > importer(properties, image->GetNumberOfComponentsPerPixel());
+	importRegion(image, region, importer, context);
+}
+
+/**
+ * Casts each property of the list to the given type. Returns false if one of
+ * them is of another type.
+ */
+template <typename TPropertyType>
+bool castProperties(const std::vector< tlp::PropertyInterface* > &properties, std::vector< TPropertyType* > &typedProperties)
+{
+	typedProperties.clear();
+	for(std::vector< tlp::PropertyInterface* >::const_iterator it = properties.begin(); it != properties.end(); ++it) {
+		TPropertyType *p = dynamic_cast< TPropertyType* >(*it);
+		if(p == NULL)
+			return false;
+		typedProperties.push_back(p);
+	}
+	return true;
+}
+
+/**
+ * Gets (creating them if needed) the properties "<name>_0" to "<name>_<n-1>",
+ * used to store each component of an image in its own property.
+ */
+template <typename TPropertyType>
+std::vector< tlp::PropertyInterface* > componentProperties(tlp::Graph *graph, const std::string &name, const unsigned int numberOfComponents)
+{
+	std::vector< tlp::PropertyInterface* > properties;
+	for(unsigned int i = 0; i < numberOfComponents; ++i) {
+		std::stringstream componentName; componentName << name << "_" << i;
+		properties.push_back(graph->getProperty< TPropertyType >(componentName.str()));
+	}
+	return properties;
+}
+
+/**
+ * Fills a property with a region of an image, calling the import function
+ * matching the actual type of the property.
+ */
+template <typename TVectorImageType>
+void fillProperty(TVectorImageType *image, const typename TVectorImageType::RegionType &region, tlp::PropertyInterface *property, FillContext &context)
+{
+	if(tlp::ColorProperty *p = dynamic_cast< tlp::ColorProperty* >(property)) {
+		importColor< TVectorImageType >(image, region, p, context);
+	} else if(tlp::IntegerProperty *p = dynamic_cast< tlp::IntegerProperty* >(property)) {
+		importData< TVectorImageType, tlp::IntegerProperty, int >(image, region, p, context, true);
+	} else if(tlp::DoubleProperty *p = dynamic_cast< tlp::DoubleProperty* >(property)) {
+		importData< TVectorImageType, tlp::DoubleProperty, double >(image, region, p, context);
+	} else if(tlp::BooleanProperty *p = dynamic_cast< tlp::BooleanProperty* >(property)) {
+		importSelection< TVectorImageType >(image, region, p, context);
+	} else if(tlp::IntegerVectorProperty *p = dynamic_cast< tlp::IntegerVectorProperty* >(property)) {
+		importVectorData< TVectorImageType, tlp::IntegerVectorProperty, int >(image, region, p, context);
+	} else if(tlp::DoubleVectorProperty *p = dynamic_cast< tlp::DoubleVectorProperty* >(property)) {
+		importVectorData< TVectorImageType, tlp::DoubleVectorProperty, double >(image, region, p, context);
+	} else {
+		throw std::runtime_error("Unsupported property type.");
 	}
 }
 
+/**
+ * Fills either a single property, or one property per component of the image.
+ */
 template <typename TVectorImageType>
-void importSelection(TVectorImageType *image, tlp::Graph *graph, tlp::BooleanProperty *property, tlp::PluginProgress *pluginProgress = NULL)
+void fillProperties(TVectorImageType *image, const typename TVectorImageType::RegionType &region, const std::vector< tlp::PropertyInterface* > &properties, FillContext &context)
 {
-	const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+	if(properties.size() == 1) {
+		fillProperty< TVectorImageType >(image, region, properties[0], context);
+		return;
+	}
 
-	if(1 != numberOfComponents)
-		throw std::runtime_error("The image must have either 1 component per pixel.");
+	std::vector< tlp::IntegerProperty* > integerProperties;
+	std::vector< tlp::DoubleProperty* > doubleProperties;
+	if(castProperties(properties, integerProperties)) {
+		importComponents< TVectorImageType, tlp::IntegerProperty, int >(image, region, integerProperties, context);
+	} else if(castProperties(properties, doubleProperties)) {
+		importComponents< TVectorImageType, tlp::DoubleProperty, double >(image, region, doubleProperties, context);
+	} else {
+		throw std::runtime_error("The components of an image can only be split into IntegerProperty or DoubleProperty.");
+	}
+}
 
-	const typename TVectorImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
-	const unsigned int numberOfPixels = imageSize[0] * imageSize[1] * imageSize[2];
-	const typename TVectorImageType::InternalPixelType *data_raw;
-	tlp::node n;
-	int i = 0;
+/**
+ * Holds the observers of the graph elements while the properties are filled,
+ * so that listeners are notified once instead of once per voxel.
+ */
+class ObserverHolder
+{
+public:
+	ObserverHolder() { tlp::Observable::holdObservers(); }
+	~ObserverHolder() { tlp::Observable::unholdObservers(); }
+};
 
-	itk::ImageRegionConstIterator< TVectorImageType > iterator(image, image->GetLargestPossibleRegion());
-	forEach(n, graph->getNodes())
+/**
+ * Checks that the graph has one node per pixel kept by the sampling of the
+ * options, for an image whose largest possible region is given.
+ */
+template <typename TRegionType>
+void checkNodeCount(const FillContext &context, const TRegionType &largest)
+{
+	const uint64_t imageSize[3] = { largest.GetSize(0), largest.GetSize(1), largest.GetSize(2) };
+	if(context.nodes.size() != resolveSampling(context.options.sampling, imageSize).numberOfSamples())
+		throw std::runtime_error("The number of nodes of the graph does not match the size of the image");
+}
+
+/**
+ * Fills the properties from an image previously decoded by ReadImageVisitor.
+ * Must be dispatched on the same component type as the read.
+ */
+class FillPropertyVisitor
+{
+private:
+	itk::DataObject *image;
+	const std::vector< tlp::PropertyInterface* > &properties;
+	FillContext &context;
+
+public:
+	FillPropertyVisitor(itk::DataObject *image, const std::vector< tlp::PropertyInterface* > &properties, FillContext &context) :
+		image(image), properties(properties), context(context)
+	{}
+
+	template <typename TPixel>
+	void visit()
 	{
-		data_raw = iterator.Get().GetDataPointer();
-		property->setNodeValue(n, data_raw[0] > 0);
+		typedef itk::VectorImage< TPixel, 3 > ImageType;
+		ImageType *typedImage = dynamic_cast< ImageType* >(image);
 
-		++i;
-		reportProgress(pluginProgress, i, numberOfPixels);
+		checkNodeCount(context, typedImage->GetLargestPossibleRegion());
 
-		++iterator;
+		ObserverHolder holder;
+		fillProperties< ImageType >(typedImage, typedImage->GetLargestPossibleRegion(), properties, context);
 	}
+};
+
+/**
+ * Decodes an image slab by slab and fills the properties with each slab before
+ * decoding the next one, so that only one slab is held in memory.
+ */
+class StreamPropertyVisitor
+{
+private:
+	const std::string &file;
+	const uint64_t slabDepth;
+	const std::vector< tlp::PropertyInterface* > &properties;
+	FillContext &context;
+
+public:
+	StreamPropertyVisitor(const std::string &file, const uint64_t slabDepth, const std::vector< tlp::PropertyInterface* > &properties, FillContext &context) :
+		file(file), slabDepth(slabDepth), properties(properties), context(context)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		typedef typename SlabReader< TPixel >::ImageType ImageType;
+		SlabReader< TPixel > reader(file, slabDepth, context.options.sampling);
+
+		checkNodeCount(context, reader.image()->GetLargestPossibleRegion());
+
+		ObserverHolder holder;
+		while(context.readNext(reader))
+			fillProperties< ImageType >(reader.image(), reader.region(), properties, context);
+	}
+};
+
+/**
+ * Fills the properties from an uncompressed MetaImage, reading the voxel
+ * values straight from the mapped data file, one window of slices at a time.
+ */
+class MappedPropertyVisitor
+{
+private:
+	const MappableMetaImage &source;
+	const uint64_t slabDepth;
+	const std::vector< tlp::PropertyInterface* > &properties;
+	FillContext &context;
+
+public:
+	MappedPropertyVisitor(const MappableMetaImage &source, const uint64_t slabDepth, const std::vector< tlp::PropertyInterface* > &properties, FillContext &context) :
+		source(source), slabDepth(slabDepth), properties(properties), context(context)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		typedef typename MappedSlabReader< TPixel >::ImageType ImageType;
+		MappedSlabReader< TPixel > reader(source, slabDepth, context.options.sampling);
+
+		checkNodeCount(context, reader.largestPossibleRegion());
+
+		ObserverHolder holder;
+		while(context.readNext(reader))
+			fillProperties< ImageType >(reader.image(), reader.region(), properties, context);
+	}
+};
+
+/**
+ * Number of slices of the windows mapped by MappedPropertyVisitor, for the
+ * given memory budget (in MB, 0 meaning no budget).
+ */
+inline uint64_t mappedSlabDepth(const MappableMetaImage &source, const unsigned int budget)
+{
+	return computeSlabDepth(source.info, budget > 0 ? budget : MAPPED_WINDOW_SIZE);
 }
 
 #endif /* GRAPHFILLINGFUNCTIONS2_H */
@@ -0,0 +1,36 @@
+#ifndef GRIDATTRIBUTES_H
+#define GRIDATTRIBUTES_H
+
+#include <tulip/Graph.h>
+
+#include <stdexcept>
+#include <string>
+
+/**
+ * Reads an attribute stored by the "Import image" plugin. The attributes are
+ * stored on the imported graph, a subgraph reads them from the closest
+ * ancestor holding them.
+ */
+template <typename T>
+bool getGridAttribute(tlp::Graph *graph, const std::string &name, T &value)
+{
+	while(!graph->getAttribute< T >(name, value)) {
+		tlp::Graph *parent = graph->getSuperGraph();
+		if(parent == NULL || parent == graph)
+			return false;
+		graph = parent;
+	}
+	return true;
+}
+
+/**
+ * Reads the dimensions of the grid, throws if the graph (or one of its
+ * ancestors) has not been created by the "Import image" plugin.
+ */
+inline void getGridDimensions(tlp::Graph *graph, int &width, int &height, int &depth)
+{
+	if(!(getGridAttribute< int >(graph, "width", width) && getGridAttribute< int >(graph, "height", height) && getGridAttribute< int >(graph, "depth", depth)))
+		throw std::runtime_error("Unable to get the image dimensions from the graph. Make sure it has been created by the \"Import image\" plugin");
+}
+
+#endif /* GRIDATTRIBUTES_H */
@@ -0,0 +1,177 @@
+#ifndef GRIDBUILDER_H
+#define GRIDBUILDER_H
+
+#include <algorithm>
+#include <climits>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Neighborhood.h"
+#include "ProgressUtils.h"
+#include "ThreadPoolUtils.h"
+#include "VoxelMask.h"
+#include "VoxelNodeMap.h"
+
+/**
+ * Number of voxels whose nodes or edges are generated before being added to
+ * the graph.
+ */
+const uint64_t GRID_BATCH_SIZE = 1 << 20;
+
+typedef std::vector< std::pair< tlp::node, tlp::node > > EdgeList;
+
+/**
+ * Generates the edges leaving each voxel of a range of rows towards its
+ * forward neighbors, one list per row. Voxels without a node (invalid) are
+ * skipped.
+ */
+class GridEdgesTask
+{
+private:
+	const VoxelNodeMap &nodes;
+	const int64_t width, height, depth;
+	const std::vector< NeighborhoodStencil::Offset > &offsets;
+	const uint64_t firstRow;
+	std::vector< EdgeList > &rows;
+
+public:
+	GridEdgesTask(const VoxelNodeMap &nodes, const int64_t width, const int64_t height, const int64_t depth,
+	              const std::vector< NeighborhoodStencil::Offset > &offsets, const uint64_t firstRow, std::vector< EdgeList > &rows) :
+		nodes(nodes), width(width), height(height), depth(depth), offsets(offsets), firstRow(firstRow), rows(rows)
+	{}
+
+	void operator()(const uint64_t begin, const uint64_t end) const
+	{
+		for(uint64_t r = begin; r < end; ++r) {
+			EdgeList &edges = rows[r];
+			edges.clear();
+
+			const int64_t y = (firstRow + r) % height, z = (firstRow + r) / height;
+			for(int64_t x = 0; x < width; ++x) {
+				const tlp::node source = nodes[x + (y + z * height) * width];
+				if(!source.isValid())
+					continue;
+
+				for(std::vector< NeighborhoodStencil::Offset >::const_iterator o = offsets.begin(); o != offsets.end(); ++o) {
+					const int64_t nx = x + o->dx, ny = y + o->dy, nz = z + o->dz;
+					if(nx < 0 || nx >= width || ny < 0 || ny >= height || nz >= depth)
+						continue;
+
+					const tlp::node target = nodes[nx + (ny + nz * height) * width];
+					if(target.isValid())
+						edges.push_back(std::make_pair(source, target));
+				}
+			}
+		}
+	}
+};
+
+/**
+ * Throws when a grid of numberOfNodes nodes cannot be created. To be called
+ * before allocating anything sized by the grid.
+ */
+inline void checkGridSize(const uint64_t width, const uint64_t height, const uint64_t depth, const uint64_t numberOfNodes)
+{
+	// The dimensions are stored in int graph attributes.
+	if(width > INT_MAX || height > INT_MAX || depth > INT_MAX) {
+		std::stringstream e; e << "The grid would be " << width << "x" << height << "x" << depth << ", more than " << INT_MAX << " voxels along an axis. "
+		                       << "Import a region of the image or use a stride.";
+		throw std::runtime_error(e.str());
+	}
+	if(numberOfNodes > MAX_GRID_NODES) {
+		std::stringstream e; e << "The grid would have " << numberOfNodes << " nodes, more than a graph can hold (" << MAX_GRID_NODES << "). "
+		                       << "Import a region of the image, with a stride or a mask.";
+		throw std::runtime_error(e.str());
+	}
+}
+
+/**
+ * Adds a width x height x depth grid of nodes to the graph, in raster order,
+ * and connects each of them to its neighbors in the stencil.
+ *
+ * The nodes are added GRID_BATCH_SIZE voxels at a time and the index of the
+ * grid is recorded as they are (see VoxelIndexBuilder), so no per voxel table
+ * is built for a dense grid. The edges are then generated in parallel, a
+ * batch of rows at a time, and added to the graph in bulk. The dimensions are
+ * stored in the "width", "height" and "depth" attributes of the graph, the
+ * neighborhood in the "neighborhood_type" and "neighborhood_radius"
+ * attributes.
+ *
+ * With an implicit neighborhood, no edge is created: the neighbors are
+ * computed on demand by ImplicitNeighborhood.
+ *
+ * When a mask is given, the grid is sparse: only the voxels of the mask get a
+ * node, and the edges only link them.
+ */
+inline void buildGrid(tlp::Graph *graph, const uint64_t width, const uint64_t height, const uint64_t depth,
+                      const NeighborhoodStencil &stencil, const bool implicitNeighborhood, QThreadPool &pool, tlp::PluginProgress *pluginProgress = NULL,
+                      const VoxelMask *mask = NULL)
+{
+	const uint64_t numberOfVoxels = width * height * depth;
+	const uint64_t numberOfNodes = mask == NULL ? numberOfVoxels : mask->count();
+	checkGridSize(width, height, depth, numberOfNodes);
+
+	graph->setAttribute< int >("width", width);
+	graph->setAttribute< int >("height", height);
+	graph->setAttribute< int >("depth", depth);
+	graph->setAttribute< std::string >("neighborhood_type", NeighborhoodStencil::typeName(stencil.type()));
+	graph->setAttribute< double >("neighborhood_radius", stencil.radius());
+	graph->setAttribute< bool >("implicit_neighborhood", implicitNeighborhood);
+
+	ProgressReporter progress(pluginProgress);
+
+	VoxelIndexBuilder index(graph);
+	std::vector< tlp::node > added;
+	for(uint64_t first = 0; first < numberOfVoxels; first += GRID_BATCH_SIZE) {
+		const uint64_t last = std::min(numberOfVoxels, first + GRID_BATCH_SIZE);
+		uint64_t count = last - first;
+		if(mask != NULL) {
+			count = 0;
+			for(uint64_t v = first; v < last; ++v)
+				count += (*mask)[v];
+		}
+
+		graph->addNodes(count, added);
+
+		std::vector< tlp::node >::const_iterator n = added.begin();
+		for(uint64_t v = first; v < last; ++v) {
+			if(mask == NULL || (*mask)[v])
+				index.add(v, *n++);
+		}
+
+		progress.update(last, numberOfVoxels);
+	}
+	index.finish();
+
+	const std::vector< NeighborhoodStencil::Offset > &offsets = stencil.forwardOffsets();
+	if(implicitNeighborhood || offsets.empty() || numberOfNodes == 0)
+		return;
+
+	const VoxelNodeMap nodes(graph);
+	const uint64_t numberOfRows = height * depth;
+	const uint64_t rowsPerBatch = std::min(numberOfRows, std::max< uint64_t >(pool.maxThreadCount(), GRID_BATCH_SIZE / width));
+
+	std::vector< EdgeList > rows(rowsPerBatch);
+	EdgeList batchEdges;
+	std::vector< tlp::edge > addedEdges;
+
+	for(uint64_t row = 0; row < numberOfRows; row += rowsPerBatch) {
+		const uint64_t batchRows = std::min(rowsPerBatch, numberOfRows - row);
+
+		parallelFor(pool, 0, batchRows, GridEdgesTask(nodes, width, height, depth, offsets, row, rows));
+
+		batchEdges.clear();
+		for(uint64_t r = 0; r < batchRows; ++r)
+			batchEdges.insert(batchEdges.end(), rows[r].begin(), rows[r].end());
+
+		graph->addEdges(batchEdges, addedEdges);
+
+		progress.update(row + batchRows, numberOfRows);
+	}
+}
+
+#endif /* GRIDBUILDER_H */
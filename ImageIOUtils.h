@@ -0,0 +1,229 @@
+#ifndef IMAGEIOUTILS_H
+#define IMAGEIOUTILS_H
+
+#include <itkImageIOBase.h>
+#include <itkImageIOFactory.h>
+#include <itkImageFileReader.h>
+#include <itkVectorImage.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+
+#include "ImageSampling.h"
+
+/**
+ * Header informations of an image, as reported by its ImageIO.
+ * 2D images are reported with a depth of 1.
+ */
+struct ImageInformation
+{
+	itk::ImageIOBase::IOComponentType componentType;
+	unsigned int componentSize;
+	unsigned int numberOfComponents;
+	uint64_t size[3];
+	bool canStreamRead;
+};
+
+inline ImageInformation readImageInformation(const std::string &file)
+{
+	itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(file.c_str(), itk::ImageIOFactory::ReadMode);
+	if(io.IsNull()) {
+		std::stringstream e; e << "The image located at \"" << file << "\" is not readable";
+		throw std::runtime_error(e.str());
+	}
+
+	io->SetFileName(file);
+	try {
+		io->ReadImageInformation();
+	} catch ( itk::ExceptionObject &err ) {
+		std::stringstream e; e << "The image located at \"" << file << "\" is not readable";
+		throw std::runtime_error(e.str());
+	}
+
+	if(io->GetNumberOfDimensions() > 3) {
+		std::stringstream e; e << "The image located at \"" << file << "\" has more than 3 dimensions";
+		throw std::runtime_error(e.str());
+	}
+
+	ImageInformation info;
+	info.componentType = io->GetComponentType();
+	info.componentSize = io->GetComponentSize();
+	info.numberOfComponents = io->GetNumberOfComponents();
+	info.canStreamRead = io->CanStreamRead();
+	for(unsigned int i = 0; i < 3; ++i)
+		info.size[i] = i < io->GetNumberOfDimensions() ? io->GetDimensions(i) : 1;
+
+	return info;
+}
+
+/**
+ * Computes the number of slices per slab so that a decoded slab fits in the
+ * given memory budget (in MB). A budget of 0, or an image format that cannot
+ * be partially decoded, results in a single slab holding the whole volume.
+ */
+inline uint64_t computeSlabDepth(const ImageInformation &info, const unsigned int budget)
+{
+	if(budget == 0 || !info.canStreamRead)
+		return info.size[2];
+
+	const uint64_t sliceSize = info.size[0] * info.size[1] * info.numberOfComponents * info.componentSize;
+	const uint64_t slabDepth = (budget * 1024UL * 1024UL) / sliceSize;
+
+	if(slabDepth < 1)
+		return 1;
+	return slabDepth < info.size[2] ? slabDepth : info.size[2];
+}
+
+/**
+ * Calls visitor.visit< T >(), T being the C++ type matching the component type.
+ * Component types without a dedicated instantiation are read as double.
+ */
+template <typename TVisitor>
+void dispatchComponentType(const itk::ImageIOBase::IOComponentType componentType, TVisitor &visitor)
+{
+	switch(componentType) {
+		case itk::ImageIOBase::UCHAR:
+			visitor.template visit< unsigned char >(); break;
+		case itk::ImageIOBase::USHORT:
+			visitor.template visit< unsigned short >(); break;
+		case itk::ImageIOBase::SHORT:
+			visitor.template visit< short >(); break;
+		case itk::ImageIOBase::INT:
+			visitor.template visit< int >(); break;
+		case itk::ImageIOBase::FLOAT:
+			visitor.template visit< float >(); break;
+		default:
+			visitor.template visit< double >(); break;
+	}
+}
+
+template <typename TPixel>
+typename itk::VectorImage< TPixel, 3 >::Pointer readImage(const std::string &file)
+{
+	typedef itk::VectorImage< TPixel, 3 > ImageType;
+	typedef itk::ImageFileReader< ImageType > ImageReaderType;
+
+	typename ImageReaderType::Pointer imageReader = ImageReaderType::New();
+	imageReader->SetFileName(file);
+	try {
+		imageReader->Update();
+	} catch ( itk::ExceptionObject &err ) {
+		std::stringstream e; e << "The image located at \"" << file << "\" is not readable";
+		throw std::runtime_error(e.str());
+	}
+
+	return imageReader->GetOutput();
+}
+
+/**
+ * Decodes an image one Z-slab at a time, using ITK's requested region streaming.
+ * Only the current slab is held in memory.
+ *
+ * Only the region of the sampling is decoded. When streaming with a stride
+ * along Z, the kept slices are decoded one at a time and the others skipped.
+ */
+template <typename TPixel>
+class SlabReader
+{
+public:
+	typedef itk::VectorImage< TPixel, 3 > ImageType;
+	typedef itk::ImageFileReader< ImageType > ImageReaderType;
+
+private:
+	const std::string &file;
+	uint64_t slabDepth;
+	typename ImageReaderType::Pointer imageReader;
+	typename ImageType::RegionType slab;
+	ImageSampling sampling;
+	uint64_t nextSlice;
+
+public:
+	SlabReader(const std::string &file, const uint64_t slabDepth, const ImageSampling &sampling = ImageSampling()) :
+		file(file), slabDepth(slabDepth), imageReader(ImageReaderType::New())
+	{
+		imageReader->SetFileName(file);
+		try {
+			imageReader->UpdateOutputInformation();
+		} catch ( itk::ExceptionObject &err ) {
+			std::stringstream e; e << "The image located at \"" << file << "\" is not readable";
+			throw std::runtime_error(e.str());
+		}
+
+		const typename ImageType::SizeType size = imageReader->GetOutput()->GetLargestPossibleRegion().GetSize();
+		const uint64_t imageSize[3] = { size[0], size[1], size[2] };
+		this->sampling = resolveSampling(sampling, imageSize);
+		this->nextSlice = this->sampling.index[2];
+
+		if(this->sampling.stride[2] > 1 && this->slabDepth < this->sampling.size[2])
+			this->slabDepth = 1;
+	}
+
+	~SlabReader()
+	{
+		imageReader->GetOutput()->ReleaseData();
+	}
+
+	/**
+	 * Decodes the next slab. Returns false once the whole volume has been read.
+	 */
+	bool next()
+	{
+		const uint64_t end = sampling.index[2] + sampling.size[2];
+
+		if(nextSlice >= end)
+			return false;
+
+		typename ImageType::IndexType index;
+		typename ImageType::SizeType size;
+		for(unsigned int i = 0; i < 2; ++i) {
+			index[i] = sampling.index[i];
+			size[i] = sampling.size[i];
+		}
+		index[2] = nextSlice;
+		size[2] = std::min(slabDepth, end - nextSlice);
+		slab = typename ImageType::RegionType(index, size);
+
+		imageReader->GetOutput()->SetRequestedRegion(slab);
+		try {
+			imageReader->Update();
+		} catch ( itk::ExceptionObject &err ) {
+			std::stringstream e; e << "The image located at \"" << file << "\" is not readable";
+			throw std::runtime_error(e.str());
+		}
+
+		nextSlice = sampling.nextSample(2, nextSlice + size[2]);
+		return true;
+	}
+
+	ImageType* image() const { return imageReader->GetOutput(); }
+
+	const typename ImageType::RegionType& region() const { return slab; }
+};
+
+/**
+ * Decodes an image in its native component type.
+ */
+class ReadImageVisitor
+{
+private:
+	const std::string &file;
+
+public:
+	itk::DataObject::Pointer image;
+	unsigned long long bytes;
+
+	ReadImageVisitor(const std::string &file) : file(file), bytes(0) {}
+
+	template <typename TPixel>
+	void visit()
+	{
+		typename itk::VectorImage< TPixel, 3 >::Pointer typedImage = readImage< TPixel >(file);
+		bytes = (unsigned long long)typedImage->GetLargestPossibleRegion().GetNumberOfPixels() * typedImage->GetNumberOfComponentsPerPixel() * sizeof(TPixel);
+		image = typedImage.GetPointer();
+	}
+};
+
+#endif /* IMAGEIOUTILS_H */
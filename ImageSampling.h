@@ -0,0 +1,170 @@
+#ifndef IMAGESAMPLING_H
+#define IMAGESAMPLING_H
+
+#include "GridAttributes.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+
+/**
+ * Part of an image mapped to the nodes of a graph: a region of the image (a
+ * size of 0 meaning up to the end of the image along that axis), of which one
+ * voxel every "stride" voxels is kept along each axis. The kept voxels are
+ * mapped, in raster order, to the nodes of a grid of gridSize() voxels.
+ */
+struct ImageSampling
+{
+	uint64_t index[3];
+	uint64_t size[3];
+	uint64_t stride[3];
+
+	ImageSampling()
+	{
+		for(unsigned int i = 0; i < 3; ++i) {
+			index[i] = 0;
+			size[i] = 0;
+			stride[i] = 1;
+		}
+	}
+
+	uint64_t gridSize(const unsigned int axis) const
+	{
+		return (size[axis] + stride[axis] - 1) / stride[axis];
+	}
+
+	uint64_t numberOfSamples() const
+	{
+		return gridSize(0) * gridSize(1) * gridSize(2);
+	}
+
+	/**
+	 * First kept coordinate greater than or equal to c along the axis.
+	 */
+	uint64_t nextSample(const unsigned int axis, const uint64_t c) const
+	{
+		if(c <= index[axis])
+			return index[axis];
+		return index[axis] + (c - index[axis] + stride[axis] - 1) / stride[axis] * stride[axis];
+	}
+
+	bool isWhole(const uint64_t imageSize[3]) const
+	{
+		for(unsigned int i = 0; i < 3; ++i) {
+			if(index[i] != 0 || (size[i] != 0 && size[i] != imageSize[i]) || stride[i] != 1)
+				return false;
+		}
+		return true;
+	}
+};
+
+/**
+ * Kept pixels of a region of an image: count[i] pixels along each axis, from
+ * start[i], stride[i] apart.
+ */
+struct SampledRegion
+{
+	uint64_t start[3];
+	uint64_t count[3];
+	uint64_t stride[3];
+
+	uint64_t numberOfPixels() const { return count[0] * count[1] * count[2]; }
+};
+
+/**
+ * Pixels of an ITK region (e.g. a slab) kept by a resolved sampling.
+ */
+template <typename TRegionType>
+SampledRegion sampledRegion(const ImageSampling &sampling, const TRegionType &region)
+{
+	SampledRegion sampled;
+	for(unsigned int i = 0; i < 3; ++i) {
+		const uint64_t begin = sampling.nextSample(i, region.GetIndex(i));
+		const uint64_t end = std::min< uint64_t >(region.GetIndex(i) + region.GetSize(i), sampling.index[i] + sampling.size[i]);
+		sampled.start[i] = begin;
+		sampled.count[i] = begin < end ? (end - begin + sampling.stride[i] - 1) / sampling.stride[i] : 0;
+		sampled.stride[i] = sampling.stride[i];
+	}
+	return sampled;
+}
+
+/**
+ * Replaces the sizes of 0 by the remaining size of the image, and checks that
+ * the region is inside the image.
+ */
+inline ImageSampling resolveSampling(const ImageSampling &sampling, const uint64_t imageSize[3])
+{
+	ImageSampling resolved = sampling;
+	for(unsigned int i = 0; i < 3; ++i) {
+		if(resolved.stride[i] == 0)
+			throw std::runtime_error("The stride must be greater than 0");
+
+		if(resolved.index[i] >= imageSize[i])
+			throw std::runtime_error("The region starts outside of the image");
+
+		if(resolved.size[i] == 0)
+			resolved.size[i] = imageSize[i] - resolved.index[i];
+		else if(resolved.size[i] > imageSize[i] - resolved.index[i])
+			throw std::runtime_error("The region ends outside of the image");
+	}
+	return resolved;
+}
+
+/**
+ * Parses a "x,y,z" parameter. An empty value leaves the default values.
+ */
+inline void parseSamplingParameter(const std::string &name, const std::string &value, uint64_t values[3])
+{
+	if(value.find_first_not_of(" \t") == std::string::npos)
+		return;
+
+	std::istringstream in(value);
+	char comma1 = 0, comma2 = 0;
+	int64_t x, y, z;
+	in >> x >> comma1 >> y >> comma2 >> z;
+	if(in.fail() || comma1 != ',' || comma2 != ',' || x < 0 || y < 0 || z < 0 || !(in >> std::ws).eof()) {
+		std::stringstream e; e << "The \"" << name << "\" parameter must be of the form x,y,z";
+		throw std::runtime_error(e.str());
+	}
+
+	values[0] = x; values[1] = y; values[2] = z;
+}
+
+inline std::string formatSamplingParameter(const uint64_t values[3])
+{
+	std::ostringstream out;
+	out << values[0] << "," << values[1] << "," << values[2];
+	return out.str();
+}
+
+/**
+ * The resolved sampling of an imported image is stored in the
+ * image3d_region_index, image3d_region_size and image3d_stride graph
+ * attributes, so that other images can later be loaded with the same one.
+ */
+inline void storeSampling(tlp::Graph *graph, const ImageSampling &sampling)
+{
+	graph->setAttribute< std::string >("image3d_region_index", formatSamplingParameter(sampling.index));
+	graph->setAttribute< std::string >("image3d_region_size", formatSamplingParameter(sampling.size));
+	graph->setAttribute< std::string >("image3d_stride", formatSamplingParameter(sampling.stride));
+}
+
+/**
+ * Returns the sampling stored in the graph, or the whole image if there is none.
+ */
+inline ImageSampling readSampling(tlp::Graph *graph)
+{
+	ImageSampling sampling;
+	std::string index, size, stride;
+	if(getGridAttribute< std::string >(graph, "image3d_region_index", index))
+		parseSamplingParameter("image3d_region_index", index, sampling.index);
+	if(getGridAttribute< std::string >(graph, "image3d_region_size", size))
+		parseSamplingParameter("image3d_region_size", size, sampling.size);
+	if(getGridAttribute< std::string >(graph, "image3d_stride", stride))
+		parseSamplingParameter("image3d_stride", stride, sampling.stride);
+	return sampling;
+}
+
+#endif /* IMAGESAMPLING_H */
@@ -0,0 +1,107 @@
+#ifndef IMPLICITNEIGHBORHOOD_H
+#define IMPLICITNEIGHBORHOOD_H
+
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Neighborhood.h"
+#include "VoxelNodeMap.h"
+
+/**
+ * Neighborhood of the nodes of a grid created by the "Import image" plugin,
+ * computed on demand from the geometry stored in the graph attributes
+ * ("width", "height", "depth", "neighborhood_type" and "neighborhood_radius")
+ * instead of being materialized as edges.
+ *
+ *   ImplicitNeighborhood neighborhood(graph);
+ *   tlp::node n, neighbor;
+ *   forEach(neighbor, neighborhood.getNeighbors(n)) { ... }
+ */
+class ImplicitNeighborhood
+{
+private:
+	int64_t width, height, depth;
+	NeighborhoodStencil stencil;
+	VoxelNodeMap nodes;
+
+	static NeighborhoodStencil readStencil(tlp::Graph *graph)
+	{
+		std::string type;
+		double radius;
+		if(!(getGridAttribute< std::string >(graph, "neighborhood_type", type) && getGridAttribute< double >(graph, "neighborhood_radius", radius)))
+			throw std::runtime_error("Unable to get the neighborhood from the graph. Make sure it has been created by the \"Import image\" plugin");
+
+		return NeighborhoodStencil(NeighborhoodStencil::parseType(type), radius);
+	}
+
+	/**
+	 * Skips the neighbor voxels without a node, in a sparse grid.
+	 */
+	class NodeIterator : public tlp::Iterator< tlp::node >
+	{
+	private:
+		const VoxelNodeMap &nodes;
+		VoxelNeighborIterator it;
+		tlp::node current;
+
+		void advance()
+		{
+			current = tlp::node();
+			while(!current.isValid() && it.hasNext())
+				current = nodes[it.next()];
+		}
+
+	public:
+		NodeIterator(const VoxelNodeMap &nodes, const VoxelNeighborIterator &it) :
+			nodes(nodes), it(it)
+		{
+			advance();
+		}
+
+		bool hasNext() { return current.isValid(); }
+
+		tlp::node next()
+		{
+			const tlp::node n = current;
+			advance();
+			return n;
+		}
+	};
+
+public:
+	ImplicitNeighborhood(tlp::Graph *graph) :
+		stencil(readStencil(graph)), nodes(graph)
+	{
+		int w = 0, h = 0, d = 0;
+		getGridDimensions(graph, w, h, d);
+		width = w; height = h; depth = d;
+
+		if((uint64_t)width * height * depth != nodes.size())
+			throw std::runtime_error("The number of nodes of the graph does not match the size of the image");
+	}
+
+	const NeighborhoodStencil& getStencil() const { return stencil; }
+
+	// Invalid if the voxel has no node in the graph.
+	tlp::node getNode(const uint64_t voxel) const { return nodes[voxel]; }
+
+	uint64_t getVoxel(const tlp::node n) const { return nodes.voxel(n); }
+
+	VoxelNeighborIterator getNeighborVoxels(const uint64_t voxel) const
+	{
+		return VoxelNeighborIterator(stencil, width, height, depth, voxel);
+	}
+
+	/**
+	 * Iterator on the neighbors of a node, to be deleted by the caller
+	 * (forEach does it).
+	 */
+	tlp::Iterator< tlp::node >* getNeighbors(const tlp::node n) const
+	{
+		return new NodeIterator(nodes, getNeighborVoxels(getVoxel(n)));
+	}
+};
+
+#endif /* IMPLICITNEIGHBORHOOD_H */
@@ -4,13 +4,14 @@
 #include <math.h>
 #include <stdexcept>
 
-#include <itkVectorImage.h>
-#include <itkImageFileReader.h>
-
+#include "ImageIOUtils.h"
 #include "GraphFillingFunctions2.h"
-
-typedef itk::VectorImage< double, 3 > ImageType;
-typedef typename itk::ImageFileReader< ImageType > ImageReaderType;
+#include "GridBuilder.h"
+#include "VolumeCache.h"
+#include "DiskCache.h"
+#include "SliceSeries.h"
+#include "VoxelMask.h"
+#include "PhaseStatistics.h"
 
 using namespace std;
 using namespace tlp;
@@ -77,7 +78,9 @@ const char *paramHelp[] = {
 	HTML_HELP_OPEN()
 		HTML_HELP_DEF("Type", "StringCollection")
 		HTML_HELP_BODY()
-		"The type of the of the property: Color, Integer, IntegerVector, Double, DoubleVector, Boolean."
+		"The type of the of the property: Color, Integer, IntegerVector, Double, DoubleVector, Boolean, "
+		"IntegerComponents or DoubleComponents. The last two store each component of the image in its own property, "
+		"named after the property name followed by the index of the component (data_0, data_1...)."
 		HTML_HELP_CLOSE(),
 
 	// 7 Property name
@@ -87,12 +90,209 @@ const char *paramHelp[] = {
 		HTML_HELP_BODY()
 		"The name of the property."
 		HTML_HELP_CLOSE(),
+
+	// 8 Streaming memory
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Maximum amount of memory (in MB) used to hold the decoded image. "
+		"The image is then decoded and loaded one slab of slices at a time. "
+		"0 decodes the whole image at once. Only formats supporting partial reads (e.g. MetaImage) can be streamed."
+		HTML_HELP_CLOSE(),
+
+	// 9 Threads
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Number of threads used to convert the pixels. 0 uses one thread per core."
+		HTML_HELP_CLOSE(),
+
+	// 10 Grid builder
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "StringCollection")
+		HTML_HELP_DEF("Values", "Built-in;Grid 3D")
+		HTML_HELP_DEF("Default", "Built-in")
+		HTML_HELP_BODY()
+		"How the grid is created. Built-in creates the nodes and edges in bulk, and positions the nodes while loading the image. "
+		"Grid 3D delegates to the \"Grid 3D\" import plugin, which must be installed."
+		HTML_HELP_CLOSE(),
+
+	// 11 Implicit neighborhood
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Do not create the edges of the neighborhood, only store its type and radius in the graph attributes. "
+		"The neighbors of a node are then computed on demand (see ImplicitNeighborhood.h). Requires the Built-in grid builder."
+		HTML_HELP_CLOSE(),
+
+	// 12 Cache memory
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Maximum amount of memory (in MB) used to keep decoded images for the next runs, shared with the \"Load image data\" plugin. "
+		"Only images that are not streamed nor mapped are cached. 0 disables the cache. "
+		"The hit and miss counts are stored in the image3d_cache_hits and image3d_cache_misses graph attributes."
+		HTML_HELP_CLOSE(),
+
+	// 13 Disk cache
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Keeps a decoded copy of the image next to it (&lt;image&gt;.cache.mhd and &lt;image&gt;.cache.raw), "
+		"which is memory mapped by the next imports instead of decoding the image again. "
+		"The copy is rebuilt when the image changes."
+		HTML_HELP_CLOSE(),
+
+	// 14 Series pattern
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Imports a series of 2D images, one per slice, instead of the \"File\" image. "
+		"Path of the slices, with a printf-like token for the index of the slice (e.g. /data/slice_%04d.png)."
+		HTML_HELP_CLOSE(),
+
+	// 15 Series start
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Index of the first slice of the series."
+		HTML_HELP_CLOSE(),
+
+	// 16 Series end
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Index of the last slice of the series (included)."
+		HTML_HELP_CLOSE(),
+
+	// 17 Region index
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_DEF("Default", "0,0,0")
+		HTML_HELP_BODY()
+		"Index (x,y,z) of the first voxel of the region of the image to import."
+		HTML_HELP_CLOSE(),
+
+	// 18 Region size
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_DEF("Default", "0,0,0")
+		HTML_HELP_BODY()
+		"Size (x,y,z) of the region of the image to import. 0 means up to the end of the image along that axis. "
+		"Only the region is read from the file, when its format allows it."
+		HTML_HELP_CLOSE(),
+
+	// 19 Stride
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_DEF("Default", "1,1,1")
+		HTML_HELP_BODY()
+		"Keeps one voxel every x,y,z voxels of the region along each axis (e.g. 4,4,4 for a downsampled preview). "
+		"The grid is sized to the kept voxels. The region and stride are stored in the "
+		"image3d_region_index, image3d_region_size and image3d_stride graph attributes."
+		HTML_HELP_CLOSE(),
+
+	// 20 Mask
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "StringCollection")
+		HTML_HELP_DEF("Values", "None;Threshold;Image")
+		HTML_HELP_DEF("Default", "None")
+		HTML_HELP_BODY()
+		"Only creates nodes for the voxels of interest. Threshold keeps the voxels whose first component is greater than the "
+		"\"Mask threshold\" (the image is then read twice), Image keeps the voxels that are not 0 in the \"Mask image\". "
+		"The edges only link the kept voxels, and the index of the voxel of each node is stored in the image3d_voxel_index "
+		"property, so that the other plugins can still address the voxels. Requires the Built-in grid builder."
+		HTML_HELP_CLOSE(),
+
+	// 21 Mask threshold
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Double")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Threshold of the Threshold mask."
+		HTML_HELP_CLOSE(),
+
+	// 22 Mask image
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Path of the mask of the Image mask, of the same size as the imported image."
+		HTML_HELP_CLOSE(),
+
+	// 23 Statistics log
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"The time, number of voxels and memory of each phase of the import (reading the image information, computing the mask, "
+		"creating the grid, loading the image) are stored in the image3d_stats graph attribute. "
+		"When true, they are also written to the debug output of Tulip."
+		HTML_HELP_CLOSE(),
+
+	// 24 Value statistics
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Computes the min, max, mean, variance and histogram of each component of the imported voxels while loading the image, "
+		"and stores them in the image3d_&lt;Property name&gt;_min, _max, _mean, _variance, _histogram_range and _histogram_&lt;component&gt; graph attributes."
+		HTML_HELP_CLOSE(),
+
+	// 25 Histogram bins
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "256")
+		HTML_HELP_BODY()
+		"Number of bins of the histograms of the value statistics. 0 disables the histograms."
+		HTML_HELP_CLOSE(),
+
+	// 26 Histogram range
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Range (low,high) of the histograms of the value statistics, values outside of it are counted in the first or last bin. "
+		"When empty, the range of the component type of the image is used (no histogram is computed for float and double images)."
+		HTML_HELP_CLOSE(),
+
+	// 27 Intensity mapping
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "StringCollection")
+		HTML_HELP_DEF("Values", "None;Window;Min/Max")
+		HTML_HELP_DEF("Default", "None")
+		HTML_HELP_BODY()
+		"Maps the values of the image linearly to [0, 255] when importing it as a Color or Integer property (e.g. for 12 or 16-bit images). "
+		"Window maps the window defined by \"Window level\" and \"Window width\", Min/Max maps the range of the values of the image "
+		"(which is then read twice). Values outside of the window are clamped. None casts the values."
+		HTML_HELP_CLOSE(),
+
+	// 28 Window level
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Double")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Center of the window of the Window intensity mapping."
+		HTML_HELP_CLOSE(),
+
+	// 29 Window width
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Double")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Width of the window of the Window intensity mapping."
+		HTML_HELP_CLOSE(),
 };
 }
 
 class ImportImage: public ImportModule {
 private:
-	enum property_t { COLOR, INTEGER, INTEGERVECTOR, DOUBLE, DOUBLEVECTOR, BOOLEAN };
+	enum property_t { COLOR, INTEGER, INTEGERVECTOR, INTEGERCOMPONENTS, DOUBLE, DOUBLEVECTOR, DOUBLECOMPONENTS, BOOLEAN };
 	property_t property_type;
 	std::string property_name;
 
@@ -102,35 +302,107 @@ public:
 	ImportImage(PluginContext *context) :
 		ImportModule(context)
 	{
-		addDependency("Grid 3D", "1.1");
-
 		addInParameter< std::string >          ("file::File",           paramHelp[0], "");
 		addInParameter< tlp::StringCollection >("Neighborhood type",    paramHelp[1], "Circular;Square");
 		addInParameter< double >               ("Neighborhood radius",  paramHelp[2], "0");
 		addInParameter< bool >                 ("Positionning",         paramHelp[3], "true");
 		addInParameter< double >               ("Spacing",              paramHelp[4], "1.0");
-		addInParameter< tlp::StringCollection >("Property type",        paramHelp[6], "Color;Integer;IntegerVector;Double;DoubleVector;Boolean");
+		addInParameter< tlp::StringCollection >("Property type",        paramHelp[6], "Color;Integer;IntegerVector;IntegerComponents;Double;DoubleVector;DoubleComponents;Boolean");
 		addInParameter< std::string >          ("Property name",        paramHelp[7], "data");
 		addInParameter< bool >                 ("Convert to grayscale", paramHelp[5], "false");
+		addInParameter< unsigned int >         ("Streaming memory",     paramHelp[8], "0", false);
+		addInParameter< unsigned int >         ("Threads",              paramHelp[9], "0", false);
+		addInParameter< tlp::StringCollection >("Grid builder",         paramHelp[10], "Built-in;Grid 3D", false);
+		addInParameter< bool >                 ("Implicit neighborhood", paramHelp[11], "false", false);
+		addInParameter< unsigned int >         ("Cache memory",         paramHelp[12], "0", false);
+		addInParameter< bool >                 ("Disk cache",           paramHelp[13], "false", false);
+		addInParameter< std::string >          ("Series pattern",       paramHelp[14], "", false);
+		addInParameter< unsigned int >         ("Series start",         paramHelp[15], "0", false);
+		addInParameter< unsigned int >         ("Series end",           paramHelp[16], "0", false);
+		addInParameter< std::string >          ("Region index",         paramHelp[17], "0,0,0", false);
+		addInParameter< std::string >          ("Region size",          paramHelp[18], "0,0,0", false);
+		addInParameter< std::string >          ("Stride",               paramHelp[19], "1,1,1", false);
+		addInParameter< tlp::StringCollection >("Mask",                 paramHelp[20], "None;Threshold;Image", false);
+		addInParameter< double >               ("Mask threshold",       paramHelp[21], "0", false);
+		addInParameter< std::string >          ("file::Mask image",     paramHelp[22], "", false);
+		addInParameter< bool >                 ("Statistics log",       paramHelp[23], "false", false);
+		addInParameter< bool >                 ("Value statistics",     paramHelp[24], "false", false);
+		addInParameter< unsigned int >         ("Histogram bins",       paramHelp[25], "256", false);
+		addInParameter< std::string >          ("Histogram range",      paramHelp[26], "", false);
+		addInParameter< tlp::StringCollection >("Intensity mapping",    paramHelp[27], "None;Window;Min/Max", false);
+		addInParameter< double >               ("Window level",         paramHelp[28], "0", false);
+		addInParameter< double >               ("Window width",         paramHelp[29], "0", false);
 	}
 	~ImportImage() {}
 
 	bool importGraph()
 	{
 		try {
-			std::string file;
-			bool convert_to_grayscale;
-			tlp::StringCollection property_type_tmp;
+			std::string file, series_pattern, region_index, region_size, stride, mask_file, histogram_range;
+			FillOptions options;
+			VoxelStatistics value_statistics;
+			unsigned int streaming_memory = 0, cache_memory = 0, series_start = 0, series_end = 0, histogram_bins = 256;
+			tlp::StringCollection property_type_tmp, neighborhood_type_tmp, grid_builder_tmp, mask_tmp, intensity_mapping_tmp;
+			double neighborhood_radius, spacing, mask_threshold = 0, window_level = 0, window_width = 0;
+			bool positionning, implicit_neighborhood = false, disk_cache = false, statistics_log = false, compute_value_statistics = false;
+			PhaseStatistics statistics;
 
 			if(dataSet == NULL)
 				throw std::runtime_error("No dataset provided");
 
 			CHECK_PROP_PROVIDED("file::File", file);
-			CHECK_PROP_PROVIDED("Convert to grayscale", convert_to_grayscale);
+			CHECK_PROP_PROVIDED("Neighborhood type", neighborhood_type_tmp);
+			CHECK_PROP_PROVIDED("Neighborhood radius", neighborhood_radius);
+			CHECK_PROP_PROVIDED("Positionning", positionning);
+			CHECK_PROP_PROVIDED("Spacing", spacing);
+			CHECK_PROP_PROVIDED("Convert to grayscale", options.convert_to_grayscale);
 			CHECK_PROP_PROVIDED("Property type", property_type_tmp);
 			CHECK_PROP_PROVIDED("Property name", property_name);
-
-			if(file.empty()) {
+			dataSet->get("Streaming memory", streaming_memory);
+			dataSet->get("Cache memory", cache_memory);
+			dataSet->get("Disk cache", disk_cache);
+			dataSet->get("Threads", options.threads);
+			dataSet->get("Series pattern", series_pattern);
+			dataSet->get("Series start", series_start);
+			dataSet->get("Series end", series_end);
+			dataSet->get("Region index", region_index);
+			dataSet->get("Region size", region_size);
+			dataSet->get("Stride", stride);
+			dataSet->get("Mask threshold", mask_threshold);
+			dataSet->get("file::Mask image", mask_file);
+			dataSet->get("Statistics log", statistics_log);
+			dataSet->get("Value statistics", compute_value_statistics);
+			dataSet->get("Histogram bins", histogram_bins);
+			dataSet->get("Histogram range", histogram_range);
+			dataSet->get("Window level", window_level);
+			dataSet->get("Window width", window_width);
+
+			ImageSampling sampling;
+			parseSamplingParameter("Region index", region_index, sampling.index);
+			parseSamplingParameter("Region size", region_size, sampling.size);
+			parseSamplingParameter("Stride", stride, sampling.stride);
+
+			bool builtin_grid = true;
+			if(dataSet->get("Grid builder", grid_builder_tmp))
+				builtin_grid = grid_builder_tmp.getCurrentString().compare("Grid 3D") != 0;
+
+			dataSet->get("Implicit neighborhood", implicit_neighborhood);
+			if(implicit_neighborhood && !builtin_grid)
+				throw std::runtime_error("An implicit neighborhood requires the Built-in grid builder.");
+
+			std::string mask_type("None");
+			if(dataSet->get("Mask", mask_tmp))
+				mask_type = mask_tmp.getCurrentString();
+			if(mask_type.compare("None") != 0 && !builtin_grid)
+				throw std::runtime_error("A mask requires the Built-in grid builder.");
+
+			std::string intensity_mapping("None");
+			if(dataSet->get("Intensity mapping", intensity_mapping_tmp))
+				intensity_mapping = intensity_mapping_tmp.getCurrentString();
+			if(intensity_mapping.compare("Min/Max") == 0 && !series_pattern.empty())
+				throw std::runtime_error("The Min/Max intensity mapping cannot be computed on a series, use the Window one.");
+
+			if(file.empty() && series_pattern.empty()) {
 				std::stringstream e; e << "The \"File\" parameter cannot be empty";
 				throw std::runtime_error(e.str());
 			}
@@ -146,29 +418,46 @@ public:
 				this->property_type = INTEGER;
 			} else if(property_type_tmp.getCurrentString().compare("IntegerVector") == 0) {
 				this->property_type = INTEGERVECTOR;
-			}  else if(property_type_tmp.getCurrentString().compare("Double") == 0) {
+			} else if(property_type_tmp.getCurrentString().compare("IntegerComponents") == 0) {
+				this->property_type = INTEGERCOMPONENTS;
+			} else if(property_type_tmp.getCurrentString().compare("Double") == 0) {
 				this->property_type = DOUBLE;
 			} else if(property_type_tmp.getCurrentString().compare("DoubleVector") == 0) {
 				this->property_type = DOUBLEVECTOR;
+			} else if(property_type_tmp.getCurrentString().compare("DoubleComponents") == 0) {
+				this->property_type = DOUBLECOMPONENTS;
 			} else if(property_type_tmp.getCurrentString().compare("Boolean") == 0) {
 				this->property_type = BOOLEAN;
 			} else {
 				throw std::runtime_error("Unknown property type.");
 			}
 
-			typename ImageReaderType::Pointer imageReader = ImageReaderType::New();
-			imageReader->SetFileName(file);
-			try {
-				imageReader->Update();
-			} catch ( itk::ExceptionObject & err ) {
-				std::stringstream e;
-				e << "The image located at \"" << file << "\" is not readable";
-				throw std::runtime_error(e.str());
+			if(intensity_mapping.compare("None") != 0 && this->property_type != COLOR && this->property_type != INTEGER)
+				throw std::runtime_error("The intensity mapping only applies to Color and Integer properties.");
+
+			if(intensity_mapping.compare("Window") == 0) {
+				if(!(window_width > 0))
+					throw std::runtime_error("The \"Window width\" parameter must be greater than 0");
+				options.window = IntensityWindow::fromLevelWidth(window_level, window_width);
 			}
 
-			typename ImageType::Pointer image = imageReader->GetOutput();
-			typename ImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
-			const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+			statistics.start("read information");
+
+			std::vector< std::string > series;
+			if(!series_pattern.empty())
+				series = seriesFileNames(series_pattern, series_start, series_end);
+
+			const ImageInformation info = series.empty() ? readImageInformation(file) : readSeriesInformation(series);
+			const unsigned int numberOfComponents = info.numberOfComponents;
+
+			// The grid only holds the kept voxels of the region.
+			options.sampling = resolveSampling(sampling, info.size);
+
+			if(compute_value_statistics) {
+				setHistogramParameters(value_statistics, histogram_bins, histogram_range, info.componentType);
+				options.statistics = &value_statistics;
+			}
+			const uint64_t width = options.sampling.gridSize(0), height = options.sampling.gridSize(1), depth = options.sampling.gridSize(2);
 
 			switch(this->property_type) {
 				case COLOR:
@@ -186,42 +475,171 @@ public:
 					break;
 			}
 
-			dataSet->set< unsigned int >("Width", imageSize[0]);
-			dataSet->set< unsigned int >("Height", imageSize[1]);
-			dataSet->set< unsigned int >("Depth", imageSize[2]);
+			if(pluginProgress)
+				pluginProgress->setComment("Creating the grid");
+
+			QThreadPool pool;
+			pool.setMaxThreadCount(threadCount(options.threads));
+
+			// Fails before the mask or the grid are allocated. The number of nodes of a
+			// sparse grid is only known once the mask is computed (one bit per voxel).
+			checkGridSize(width, height, depth, mask_type.compare("None") != 0 ? 0 : width * height * depth);
+
+			// Sparse grid: only the voxels of the mask get a node.
+			VoxelMask mask;
+			if(mask_type.compare("None") != 0) {
+				std::string mask_source = file;
+				ImageInformation mask_info = info;
+				if(mask_type.compare("Image") == 0) {
+					if(mask_file.empty())
+						throw std::runtime_error("The \"Mask image\" parameter cannot be empty");
+
+					mask_source = mask_file;
+					mask_info = readImageInformation(mask_file);
+					mask_threshold = 0;
+					if(mask_info.size[0] != info.size[0] || mask_info.size[1] != info.size[1] || mask_info.size[2] != info.size[2])
+						throw std::runtime_error("The dimensions of the mask and the image do not match");
+				} else if(!series.empty()) {
+					throw std::runtime_error("A Threshold mask cannot be computed on a series, use an Image mask.");
+				}
+
+				if(pluginProgress)
+					pluginProgress->setComment("Computing the mask");
+
+				statistics.start("mask");
+				MaskVisitor masker(mask_source, computeSlabDepth(mask_info, streaming_memory), options.sampling, mask_threshold, pool, pluginProgress);
+				dispatchComponentType(mask_info.componentType, masker);
+				mask.swap(masker.mask);
+				statistics.stop(options.sampling.numberOfSamples());
+
+				if(pluginProgress)
+					pluginProgress->setComment("Creating the grid");
+			}
+
+			if(intensity_mapping.compare("Min/Max") == 0) {
+				if(pluginProgress)
+					pluginProgress->setComment("Computing the intensity range");
+
+				statistics.start("intensity range");
+				IntensityRangeVisitor ranger(file, computeSlabDepth(info, streaming_memory), options.sampling, pool, pluginProgress);
+				dispatchComponentType(info.componentType, ranger);
+				options.window = ranger.window;
+				statistics.stop(options.sampling.numberOfSamples());
+
+				if(pluginProgress)
+					pluginProgress->setComment("Creating the grid");
+			}
+
+			statistics.start(builtin_grid ? "grid" : "Grid 3D");
+
+			if(builtin_grid) {
+				const NeighborhoodStencil stencil(NeighborhoodStencil::parseType(neighborhood_type_tmp.getCurrentString()), neighborhood_radius);
+
+				ObserverHolder holder;
+				buildGrid(graph, width, height, depth, stencil, implicit_neighborhood, pool, pluginProgress, mask.empty() ? NULL : &mask);
+
+				// The nodes are positioned while loading the image.
+				if(positionning) {
+					options.layout = graph->getProperty< tlp::LayoutProperty >("viewLayout");
+					options.spacing = spacing;
+				}
+			} else {
+				if(!tlp::PluginLister::pluginExists("Grid 3D"))
+					throw std::runtime_error("The \"Grid 3D\" import plugin is not available");
+
+				dataSet->set< unsigned int >("Width", width);
+				dataSet->set< unsigned int >("Height", height);
+				dataSet->set< unsigned int >("Depth", depth);
+
+				if(!tlp::importGraph("Grid 3D", *dataSet, pluginProgress, graph))
+					throw std::runtime_error("Unable to create the grid");
+
+				// The "Grid 3D" plugin creates the nodes in raster order.
+				std::vector< tlp::node > gridNodes;
+				gridNodes.reserve(graph->numberOfNodes());
+				tlp::node n;
+				forEach(n, graph->getNodes())
+					gridNodes.push_back(n);
+				storeVoxelIndex(graph, gridNodes);
+			}
+
+			statistics.stop(graph->numberOfNodes());
 
-			if(!tlp::importGraph("Grid 3D", *dataSet, pluginProgress, graph))
-				throw std::runtime_error("Unable to create the grid");
+			storeSampling(graph, options.sampling);
 
 			if(pluginProgress)
 				pluginProgress->setComment("Loading the image");
 
+			std::vector< tlp::PropertyInterface* > p;
 			switch(this->property_type) {
-				case COLOR: {
-					tlp::ColorProperty *p = graph->getProperty< tlp::ColorProperty >(this->property_name);
-					importColor< ImageType >(image, graph, p, convert_to_grayscale, pluginProgress);
-				} break;
-				case INTEGER: {
-					tlp::IntegerProperty *p = graph->getProperty< tlp::IntegerProperty >(this->property_name);
-					importData< ImageType, tlp::IntegerProperty, int >(image, graph, p, pluginProgress);
-				} break;
-				case DOUBLE: {
-					tlp::DoubleProperty *p = graph->getProperty< tlp::DoubleProperty >(this->property_name);
-					importData< ImageType, tlp::DoubleProperty, double >(image, graph, p, pluginProgress);
-				} break;
-				case BOOLEAN: {
-					tlp::BooleanProperty *p = graph->getProperty< tlp::BooleanProperty >(this->property_name);
-					importSelection< ImageType >(image, graph, p, pluginProgress);
-				} break;
-				case INTEGERVECTOR: {
-					tlp::IntegerVectorProperty *p = graph->getProperty< tlp::IntegerVectorProperty >(this->property_name);
-					importVectorData< ImageType, tlp::IntegerVectorProperty, int >(image, graph, p, pluginProgress);
-				} break;
-				case DOUBLEVECTOR: {
-					tlp::DoubleVectorProperty *p = graph->getProperty< tlp::DoubleVectorProperty >(this->property_name);
-					importVectorData< ImageType, tlp::DoubleVectorProperty, double >(image, graph, p, pluginProgress);
-				} break;
+				case COLOR:             p.push_back(graph->getProperty< tlp::ColorProperty >(this->property_name)); break;
+				case INTEGER:           p.push_back(graph->getProperty< tlp::IntegerProperty >(this->property_name)); break;
+				case DOUBLE:            p.push_back(graph->getProperty< tlp::DoubleProperty >(this->property_name)); break;
+				case BOOLEAN:           p.push_back(graph->getProperty< tlp::BooleanProperty >(this->property_name)); break;
+				case INTEGERVECTOR:     p.push_back(graph->getProperty< tlp::IntegerVectorProperty >(this->property_name)); break;
+				case DOUBLEVECTOR:      p.push_back(graph->getProperty< tlp::DoubleVectorProperty >(this->property_name)); break;
+				case INTEGERCOMPONENTS: p = componentProperties< tlp::IntegerProperty >(graph, this->property_name, numberOfComponents); break;
+				case DOUBLECOMPONENTS:  p = componentProperties< tlp::DoubleProperty >(graph, this->property_name, numberOfComponents); break;
 			}
+
+			// Uncompressed MetaImage files and disk caches are mapped in memory, other
+			// images are decoded in their native component type, no conversion to double.
+			MappableMetaImage mappable;
+			bool mapped = series.empty() && readMappableMetaImage(file, mappable);
+			if(!mapped && disk_cache && series.empty()) {
+				if(pluginProgress)
+					pluginProgress->setComment("Opening the disk cache");
+				statistics.start("disk cache");
+				mapped = openDiskCache(file, info, streaming_memory, mappable);
+				statistics.stop(0);
+				if(pluginProgress)
+					pluginProgress->setComment("Loading the image");
+			}
+
+			const VoxelNodeMap nodes(graph);
+			FillContext context(nodes, options, pool, pluginProgress);
+			const bool cached = !mapped && series.empty() && cache_memory > 0 && options.sampling.isWhole(info.size) && computeSlabDepth(info, streaming_memory) >= info.size[2];
+
+			statistics.start(cached ? "decode" : "load");
+
+			// Stopping keeps the grid, with the slabs loaded so far.
+			try {
+				if(!series.empty()) {
+					fillFromSeries(series, info, p, context);
+				} else if(mapped) {
+					MappedPropertyVisitor filler(mappable, mappedSlabDepth(mappable, streaming_memory), p, context);
+					dispatchComponentType(mappable.info.componentType, filler);
+				} else if(cached) {
+					itk::DataObject::Pointer image = readCachedImage(file, info.componentType, cache_memory);
+					statistics.start("load");
+					FillPropertyVisitor filler(image, p, context);
+					dispatchComponentType(info.componentType, filler);
+				} else {
+					StreamPropertyVisitor filler(file, computeSlabDepth(info, streaming_memory), p, context);
+					dispatchComponentType(info.componentType, filler);
+				}
+			} catch(ProgressInterruption &ex) {
+				if(ex.state != tlp::TLP_STOP)
+					throw;
+			}
+
+			if(context.decoding.GetNumberOfStops() > 0)
+				statistics.detail("decode", context.decoding.GetTotal());
+			statistics.stop(graph->numberOfNodes());
+
+			if(options.statistics != NULL)
+				value_statistics.store(graph, "image3d_" + this->property_name);
+
+			if(cache_memory > 0)
+				storeCacheStatistics(graph);
+
+			statistics.store(graph, PLUGIN_NAME, statistics_log);
+		} catch(ProgressInterruption &ex) {
+			// Cancelled, or stopped before the grid was complete: nothing usable is kept.
+			graph->clear();
+			if(pluginProgress)
+				pluginProgress->setError(ex.what());
+			return false;
 		} catch(std::runtime_error &ex) {
 			if(pluginProgress)
 				pluginProgress->setError(ex.what());
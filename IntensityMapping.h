@@ -0,0 +1,196 @@
+#ifndef INTENSITYMAPPING_H
+#define INTENSITYMAPPING_H
+
+#include <itkVectorImage.h>
+
+#include <limits>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ImageIOUtils.h"
+#include "ImageSampling.h"
+#include "ProgressUtils.h"
+#include "ThreadPoolUtils.h"
+#include "VoxelStatistics.h"
+
+/**
+ * Window of sample values mapped linearly to [0, 255] when an image is
+ * loaded into a Color or Integer property (e.g. to display a 12 or 16-bit
+ * image): low is mapped to 0, high to 255, the values outside of the window
+ * are clamped. Disabled by default, the values are then cast.
+ */
+struct IntensityWindow
+{
+	bool enabled;
+	double low, high;
+
+	IntensityWindow() :
+		enabled(false), low(0), high(0)
+	{}
+
+	IntensityWindow(const double low, const double high) :
+		enabled(true), low(low), high(high)
+	{
+		if(!(high > low))
+			throw std::runtime_error("The intensity window must not be empty");
+	}
+
+	/**
+	 * Window centered on level, as in medical image viewers.
+	 */
+	static IntensityWindow fromLevelWidth(const double level, const double width)
+	{
+		return IntensityWindow(level - width / 2, level + width / 2);
+	}
+};
+
+/**
+ * Base class of the IntensityMappers, so that a mapper can be kept by code
+ * which does not know the pixel type (see FillContext::intensityMapper).
+ */
+class IntensityMapperBase
+{
+public:
+	virtual ~IntensityMapperBase() {}
+};
+
+/**
+ * Applies an IntensityWindow to samples of type TPixel. For integer types of
+ * at most 16 bits, the mapping of every possible value is precomputed in a
+ * lookup table, so that mapping a sample costs a single table read. The table
+ * is built once per fill, not once per slab.
+ */
+template <typename TPixel>
+class IntensityMapper : public IntensityMapperBase
+{
+private:
+	double low, scale;
+	std::vector< unsigned char > table;
+
+	static bool hasTable()
+	{
+		return std::numeric_limits< TPixel >::is_integer && sizeof(TPixel) <= 2;
+	}
+
+	unsigned char compute(const double value) const
+	{
+		const double mapped = (value - low) * scale;
+		if(!(mapped > 0))
+			return 0;
+		if(mapped >= 255)
+			return 255;
+		return (unsigned char)(mapped + 0.5);
+	}
+
+public:
+	IntensityMapper(const IntensityWindow &window) :
+		low(window.low), scale(window.enabled ? 255 / (window.high - window.low) : 0)
+	{
+		if(!window.enabled || !hasTable())
+			return;
+
+		const long first = (long)std::numeric_limits< TPixel >::min(), last = (long)std::numeric_limits< TPixel >::max();
+		table.resize(last - first + 1);
+		for(long v = first; v <= last; ++v)
+			table[v - first] = compute(v);
+	}
+
+	unsigned char operator()(const TPixel value) const
+	{
+		if(hasTable())
+			return table[(long)value - (long)std::numeric_limits< TPixel >::min()];
+		return compute(value);
+	}
+};
+
+/**
+ * Computes the min and max of the samples of a range of slices of a slab.
+ */
+template <typename TVectorImageType>
+class RangeSlicesTask
+{
+private:
+	const TVectorImageType *image;
+	const SampledRegion &slab;
+	VoxelStatistics &statistics;
+
+public:
+	RangeSlicesTask(const TVectorImageType *image, const SampledRegion &slab, VoxelStatistics &statistics) :
+		image(image), slab(slab), statistics(statistics)
+	{}
+
+	void operator()(const uint64_t begin, const uint64_t end) const
+	{
+		const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+		const typename TVectorImageType::InternalPixelType *buffer = image->GetBufferPointer();
+		StatisticsAccumulator< typename TVectorImageType::InternalPixelType > accumulator(statistics, numberOfComponents);
+
+		typename TVectorImageType::IndexType index;
+		index[0] = slab.start[0];
+		for(uint64_t z = begin; z < end; ++z) {
+			index[2] = slab.start[2] + z * slab.stride[2];
+			for(uint64_t y = 0; y < slab.count[1]; ++y) {
+				index[1] = slab.start[1] + y * slab.stride[1];
+				accumulator.add(buffer + image->ComputeOffset(index) * numberOfComponents, slab.count[0], slab.stride[0] * numberOfComponents);
+			}
+		}
+
+		accumulator.mergeInto(statistics);
+	}
+};
+
+/**
+ * Computes the window of the Min/Max intensity mapping: the range of the
+ * samples (of all the components) of the sampled region of an image, which
+ * is streamed slab by slab.
+ */
+class IntensityRangeVisitor
+{
+private:
+	const std::string &file;
+	const uint64_t slabDepth;
+	const ImageSampling &sampling;
+	QThreadPool &pool;
+	tlp::PluginProgress *pluginProgress;
+
+public:
+	IntensityWindow window;
+
+	IntensityRangeVisitor(const std::string &file, const uint64_t slabDepth, const ImageSampling &sampling, QThreadPool &pool, tlp::PluginProgress *pluginProgress = NULL) :
+		file(file), slabDepth(slabDepth), sampling(sampling), pool(pool), pluginProgress(pluginProgress)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		typedef typename SlabReader< TPixel >::ImageType ImageType;
+		SlabReader< TPixel > reader(file, slabDepth, sampling);
+
+		const typename ImageType::SizeType size = reader.image()->GetLargestPossibleRegion().GetSize();
+		const uint64_t imageSize[3] = { size[0], size[1], size[2] };
+		const ImageSampling resolved = resolveSampling(sampling, imageSize);
+
+		ProgressReporter progress(pluginProgress);
+		VoxelStatistics statistics;
+		while(reader.next()) {
+			const SampledRegion slab = sampledRegion(resolved, reader.region());
+			if(slab.numberOfPixels() > 0)
+				parallelFor(pool, 0, slab.count[2], RangeSlicesTask< ImageType >(reader.image(), slab, statistics));
+
+			progress.update(reader.region().GetIndex(2) + reader.region().GetSize(2), size[2]);
+		}
+
+		double low = std::numeric_limits< double >::max(), high = -std::numeric_limits< double >::max();
+		for(unsigned int c = 0; c < statistics.statistics().size(); ++c) {
+			low = std::min(low, statistics.statistics()[c].min);
+			high = std::max(high, statistics.statistics()[c].max);
+		}
+
+		// A constant image is mapped to 0.
+		window = IntensityWindow(low, high > low ? high : low + 1);
+	}
+};
+
+#endif /* INTENSITYMAPPING_H */
@@ -1,17 +1,16 @@
 #include <tulip/TulipPluginHeaders.h>
 
-#include <itkVectorImage.h>
-#include <itkImageFileReader.h>
-
 #include "PluginUtils.h"
+#include "ImageIOUtils.h"
 #include "GraphFillingFunctions2.h"
+#include "VolumeCache.h"
+#include "DiskCache.h"
+#include "SliceSeries.h"
+#include "PhaseStatistics.h"
 
 #include <sstream>
 #include <stdexcept>
 
-typedef itk::VectorImage< double, 3 > ImageType;
-typedef typename itk::ImageFileReader< ImageType > ImageReaderType;
-
 namespace {
 const char* paramHelp[] = {
 	// 0 File name
@@ -36,6 +35,156 @@ const char* paramHelp[] = {
 		HTML_HELP_BODY()
 		"Indicates if the color should be converted to grayscale."
 		HTML_HELP_CLOSE(),
+
+	// 3 Streaming memory
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Maximum amount of memory (in MB) used to hold the decoded image. "
+		"The image is then decoded and loaded one slab of slices at a time. "
+		"0 decodes the whole image at once. Only formats supporting partial reads (e.g. MetaImage) can be streamed."
+		HTML_HELP_CLOSE(),
+
+	// 4 Threads
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Number of threads used to convert the pixels. 0 uses one thread per core."
+		HTML_HELP_CLOSE(),
+
+	// 5 Split components
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Stores each component of the image in its own property, named after the selected property followed by "
+		"the index of the component (data_0, data_1...). The selected property must be an IntegerProperty or a DoubleProperty."
+		HTML_HELP_CLOSE(),
+
+	// 6 Cache memory
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Maximum amount of memory (in MB) used to keep decoded images for the next runs, shared with the \"Import image\" plugin. "
+		"Only images that are not streamed nor mapped are cached. 0 disables the cache. "
+		"The hit and miss counts are stored in the image3d_cache_hits and image3d_cache_misses graph attributes."
+		HTML_HELP_CLOSE(),
+
+	// 7 Disk cache
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Keeps a decoded copy of the image next to it, shared with the \"Import image\" plugin. See the \"Import image\" plugin."
+		HTML_HELP_CLOSE(),
+
+	// 8 Series pattern
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Loads a series of 2D images, one per slice, instead of the \"Image\" file. See the \"Import image\" plugin."
+		HTML_HELP_CLOSE(),
+
+	// 9 Series start
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Index of the first slice of the series."
+		HTML_HELP_CLOSE(),
+
+	// 10 Series end
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Index of the last slice of the series (included)."
+		HTML_HELP_CLOSE(),
+
+	// 11 Region index
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Index (x,y,z) of the first voxel of the region of the image to load. See the \"Import image\" plugin. "
+		"When empty, the region the graph has been imported from is used."
+		HTML_HELP_CLOSE(),
+
+	// 12 Region size
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Size (x,y,z) of the region of the image to load. "
+		"When empty, the region the graph has been imported from is used."
+		HTML_HELP_CLOSE(),
+
+	// 13 Stride
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Keeps one voxel every x,y,z voxels of the region along each axis. "
+		"When empty, the stride the graph has been imported with is used."
+		HTML_HELP_CLOSE(),
+
+	// 14 Statistics log
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"The time, number of voxels and memory of each phase of the loading are stored in the image3d_stats graph attribute. "
+		"When true, they are also written to the debug output of Tulip."
+		HTML_HELP_CLOSE(),
+
+	// 15 Value statistics
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Computes the min, max, mean, variance and histogram of each component of the loaded voxels, "
+		"stored in the image3d_&lt;Property&gt;_* graph attributes. See the \"Import image\" plugin."
+		HTML_HELP_CLOSE(),
+
+	// 16 Histogram bins
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "256")
+		HTML_HELP_BODY()
+		"Number of bins of the histograms of the value statistics. 0 disables the histograms."
+		HTML_HELP_CLOSE(),
+
+	// 17 Histogram range
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"Range (low,high) of the histograms of the value statistics. When empty, the range of the component type of the image is used."
+		HTML_HELP_CLOSE(),
+
+	// 18 Intensity mapping
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "StringCollection")
+		HTML_HELP_DEF("Values", "None;Window;Min/Max")
+		HTML_HELP_DEF("Default", "None")
+		HTML_HELP_BODY()
+		"Maps the values of the image linearly to [0, 255] when loading it into a Color or Integer property. See the \"Import image\" plugin."
+		HTML_HELP_CLOSE(),
+
+	// 19 Window level
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Double")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Center of the window of the Window intensity mapping."
+		HTML_HELP_CLOSE(),
+
+	// 20 Window width
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Double")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Width of the window of the Window intensity mapping."
+		HTML_HELP_CLOSE(),
 };
 }
 
@@ -44,11 +193,28 @@ private:
 	std::string file;
 	tlp::PropertyInterface *property;
 	bool convert_to_grayscale;
+	bool split_components;
+	unsigned int number_of_components;
+	unsigned int threads;
+	unsigned int cache_memory;
 
 	enum property_t { COLOR, INTEGER, DOUBLE, INTEGERVECTOR, DOUBLEVECTOR, BOOLEAN };
 	property_t property_type;
 
-	typename ImageReaderType::Pointer imageReader;
+	ImageInformation info;
+	unsigned int streaming_memory;
+	bool disk_cache;
+	bool mapped;
+	MappableMetaImage mappable;
+	std::vector< std::string > series;
+	ImageSampling sampling;
+	PhaseStatistics statistics;
+	bool statistics_log;
+	bool compute_value_statistics;
+	unsigned int histogram_bins;
+	std::string histogram_range;
+	bool min_max_window;
+	IntensityWindow window;
 
 public:
 	PLUGININFORMATIONS("Load image data", "Cyrille FAUCHEUX", "2013-08-18", "", "1.0", "Image")
@@ -59,6 +225,24 @@ public:
 		addInParameter< std::string >            ("file::Image",           paramHelp[0], "");
 		addInParameter< tlp::PropertyInterface* >("Property",              paramHelp[1], "data");
 		addInParameter< bool >                   ("Convert to grayscale",  paramHelp[2], "false", false);
+		addInParameter< unsigned int >           ("Streaming memory",      paramHelp[3], "0", false);
+		addInParameter< unsigned int >           ("Threads",               paramHelp[4], "0", false);
+		addInParameter< bool >                   ("Split components",      paramHelp[5], "false", false);
+		addInParameter< unsigned int >           ("Cache memory",          paramHelp[6], "0", false);
+		addInParameter< bool >                   ("Disk cache",            paramHelp[7], "false", false);
+		addInParameter< std::string >            ("Series pattern",        paramHelp[8], "", false);
+		addInParameter< unsigned int >           ("Series start",          paramHelp[9], "0", false);
+		addInParameter< unsigned int >           ("Series end",            paramHelp[10], "0", false);
+		addInParameter< std::string >            ("Region index",          paramHelp[11], "", false);
+		addInParameter< std::string >            ("Region size",           paramHelp[12], "", false);
+		addInParameter< std::string >            ("Stride",                paramHelp[13], "", false);
+		addInParameter< bool >                   ("Statistics log",        paramHelp[14], "false", false);
+		addInParameter< bool >                   ("Value statistics",      paramHelp[15], "false", false);
+		addInParameter< unsigned int >           ("Histogram bins",        paramHelp[16], "256", false);
+		addInParameter< std::string >            ("Histogram range",       paramHelp[17], "", false);
+		addInParameter< tlp::StringCollection >  ("Intensity mapping",     paramHelp[18], "None;Window;Min/Max", false);
+		addInParameter< double >                 ("Window level",          paramHelp[19], "0", false);
+		addInParameter< double >                 ("Window width",          paramHelp[20], "0", false);
 	}
 
 	~LoadImageData() {}
@@ -71,6 +255,8 @@ public:
 			CHECK_PROP_PROVIDED("file::Image", this->file);
 			CHECK_PROP_PROVIDED("Property", this->property);
 
+			// Only read for Color properties, but always copied into the fill options.
+			this->convert_to_grayscale = false;
 			if (dynamic_cast< tlp::ColorProperty* >(this->property)) {
 				this->property_type = COLOR;
 				CHECK_PROP_PROVIDED("Convert to grayscale", this->convert_to_grayscale);
@@ -89,31 +275,100 @@ public:
 				                         "ColorProperty, IntegerProperty, DoubleProperty, IntegerVectorProperty, DoubleVectorProperty, BooleanProperty.");
 			}
 
-			if(file.empty()) {
+			std::string series_pattern;
+			unsigned int series_start = 0, series_end = 0;
+			dataSet->get("Series pattern", series_pattern);
+			dataSet->get("Series start", series_start);
+			dataSet->get("Series end", series_end);
+
+			if(file.empty() && series_pattern.empty()) {
 				std::stringstream e; e << "The \"File\" parameter cannot be empty";
 				throw std::runtime_error(e.str());
 			}
 
-			imageReader = ImageReaderType::New();
-			imageReader->SetFileName(file);
-			try {
-				imageReader->Update();
-			} catch ( itk::ExceptionObject &err ) {
-				std::stringstream e; e << "The image located at \"" << file << "\" is not readable";
-				throw std::runtime_error(e.str());
+			this->streaming_memory = 0;
+			dataSet->get("Streaming memory", this->streaming_memory);
+
+			this->cache_memory = 0;
+			dataSet->get("Cache memory", this->cache_memory);
+
+			this->threads = 0;
+			dataSet->get("Threads", this->threads);
+
+			this->split_components = false;
+			dataSet->get("Split components", this->split_components);
+
+			if(this->split_components && this->property_type != INTEGER && this->property_type != DOUBLE)
+				throw std::runtime_error("To split the components of the image, \"Property\" must be an IntegerProperty or a DoubleProperty.");
+
+			this->disk_cache = false;
+			dataSet->get("Disk cache", this->disk_cache);
+
+			this->statistics_log = false;
+			dataSet->get("Statistics log", this->statistics_log);
+
+			this->compute_value_statistics = false;
+			this->histogram_bins = 256;
+			this->histogram_range.clear();
+			dataSet->get("Value statistics", this->compute_value_statistics);
+			dataSet->get("Histogram bins", this->histogram_bins);
+			dataSet->get("Histogram range", this->histogram_range);
+
+			std::string intensity_mapping("None");
+			tlp::StringCollection intensity_mapping_tmp;
+			double window_level = 0, window_width = 0;
+			if(dataSet->get("Intensity mapping", intensity_mapping_tmp))
+				intensity_mapping = intensity_mapping_tmp.getCurrentString();
+			dataSet->get("Window level", window_level);
+			dataSet->get("Window width", window_width);
+
+			if(intensity_mapping.compare("None") != 0 && ((this->property_type != COLOR && this->property_type != INTEGER) || this->split_components))
+				throw std::runtime_error("The intensity mapping only applies to Color and Integer properties, without splitting the components.");
+
+			this->window = IntensityWindow();
+			this->min_max_window = intensity_mapping.compare("Min/Max") == 0;
+			if(this->min_max_window && !series_pattern.empty())
+				throw std::runtime_error("The Min/Max intensity mapping cannot be computed on a series, use the Window one.");
+
+			if(intensity_mapping.compare("Window") == 0) {
+				if(!(window_width > 0))
+					throw std::runtime_error("The \"Window width\" parameter must be greater than 0");
+				this->window = IntensityWindow::fromLevelWidth(window_level, window_width);
+			}
+
+			this->statistics.clear();
+			this->statistics.start("read information");
+
+			// Only the header of the image is read here, the pixels are decoded in run().
+			this->series.clear();
+			if(!series_pattern.empty()) {
+				this->series = seriesFileNames(series_pattern, series_start, series_end);
+				this->info = readSeriesInformation(this->series);
+				this->mapped = false;
+			} else {
+				this->info = readImageInformation(file);
+				this->mapped = readMappableMetaImage(file, this->mappable);
 			}
 
 			int width = 0, height = 0, depth = 0;
-			typename ImageType::Pointer image = imageReader->GetOutput();
-			typename ImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
+			getGridDimensions(graph, width, height, depth);
 
-			if(!(graph->getAttribute<int>("width", width) && graph->getAttribute<int>("height", height) && graph->getAttribute<int>("depth", depth)))
-				throw std::runtime_error("Unable to get the image dimensions from the graph. Make sure it has been created by the \"Image 3D\" import plugin");
+			std::string region_index, region_size, stride;
+			dataSet->get("Region index", region_index);
+			dataSet->get("Region size", region_size);
+			dataSet->get("Stride", stride);
 
-			if((unsigned long)width != imageSize[0] || (unsigned long)height != imageSize[1] || (unsigned long)depth != imageSize[2])
+			ImageSampling requested = readSampling(graph);
+			parseSamplingParameter("Region index", region_index, requested.index);
+			parseSamplingParameter("Region size", region_size, requested.size);
+			parseSamplingParameter("Stride", stride, requested.stride);
+			this->sampling = resolveSampling(requested, info.size);
+
+			if((uint64_t)width != sampling.gridSize(0) || (uint64_t)height != sampling.gridSize(1) || (uint64_t)depth != sampling.gridSize(2))
 				throw std::runtime_error("The dimensions of the graph and the image do not match");
 
-			const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+			const unsigned int numberOfComponents = info.numberOfComponents;
+			this->number_of_components = numberOfComponents;
 
 			switch(this->property_type) {
 				case COLOR:
@@ -131,6 +386,7 @@ public:
 					break;
 			}
 
+			this->statistics.stop(0);
 		} catch (std::runtime_error &ex) {
 			err.assign(ex.what());
 			return false;
@@ -141,38 +397,98 @@ public:
 
 	bool run() {
 		try {
-			typename ImageType::Pointer image = imageReader->GetOutput();
-			typename ImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
-
 			if(pluginProgress)
 				pluginProgress->setComment("Loading the image");
 
-			switch(this->property_type) {
-				case COLOR: {
-					tlp::ColorProperty* p = dynamic_cast< tlp::ColorProperty* >(this->property);
-					importColor< ImageType >(image, graph, p, convert_to_grayscale, pluginProgress);
-				} break;
-				case INTEGER: {
-					tlp::IntegerProperty* p = dynamic_cast< tlp::IntegerProperty* >(this->property);
-					importData< ImageType, tlp::IntegerProperty, int >(image, graph, p, pluginProgress);
-				} break;
-				case DOUBLE: {
-					tlp::DoubleProperty* p = dynamic_cast< tlp::DoubleProperty* >(this->property);
-					importData< ImageType, tlp::DoubleProperty, double >(image, graph, p, pluginProgress);
-				} break;
-				case BOOLEAN: {
-					tlp::BooleanProperty* p = dynamic_cast< tlp::BooleanProperty* >(this->property);
-					importSelection< ImageType >(image, graph, p, pluginProgress);
-				} break;
-				case INTEGERVECTOR: {
-					tlp::IntegerVectorProperty* p = dynamic_cast< tlp::IntegerVectorProperty* >(this->property);
-					importVectorData< ImageType, tlp::IntegerVectorProperty, int >(image, graph, p, pluginProgress);
-				} break;
-				case DOUBLEVECTOR: {
-					tlp::DoubleVectorProperty* p = dynamic_cast< tlp::DoubleVectorProperty* >(this->property);
-					importVectorData< ImageType, tlp::DoubleVectorProperty, double >(image, graph, p, pluginProgress);
-				} break;
+			std::vector< tlp::PropertyInterface* > properties;
+			if(!this->split_components)
+				properties.push_back(this->property);
+			else if(this->property_type == INTEGER)
+				properties = componentProperties< tlp::IntegerProperty >(graph, this->property->getName(), this->number_of_components);
+			else
+				properties = componentProperties< tlp::DoubleProperty >(graph, this->property->getName(), this->number_of_components);
+
+			FillOptions options;
+			options.convert_to_grayscale = this->convert_to_grayscale;
+			options.threads = this->threads;
+			options.sampling = this->sampling;
+
+			VoxelStatistics value_statistics;
+			if(this->compute_value_statistics) {
+				setHistogramParameters(value_statistics, this->histogram_bins, this->histogram_range, this->info.componentType);
+				options.statistics = &value_statistics;
 			}
+
+			if(!this->mapped && this->disk_cache && this->series.empty()) {
+				if(pluginProgress)
+					pluginProgress->setComment("Opening the disk cache");
+				this->statistics.start("disk cache");
+				this->mapped = openDiskCache(this->file, this->info, this->streaming_memory, this->mappable);
+				this->statistics.stop(0);
+				if(pluginProgress)
+					pluginProgress->setComment("Loading the image");
+			}
+
+			// Uncompressed MetaImage files and disk caches are mapped in memory, other
+			// images are decoded in their native component type, no conversion to double.
+			// The decoded pixels are released as soon as the properties are filled
+			// (unless kept by the cache).
+			QThreadPool pool;
+			pool.setMaxThreadCount(threadCount(this->threads));
+
+			options.window = this->window;
+			if(this->min_max_window) {
+				if(pluginProgress)
+					pluginProgress->setComment("Computing the intensity range");
+				this->statistics.start("intensity range");
+				IntensityRangeVisitor ranger(this->file, computeSlabDepth(this->info, this->streaming_memory), this->sampling, pool, pluginProgress);
+				dispatchComponentType(this->info.componentType, ranger);
+				options.window = ranger.window;
+				this->statistics.stop(this->sampling.numberOfSamples());
+				if(pluginProgress)
+					pluginProgress->setComment("Loading the image");
+			}
+
+			const VoxelNodeMap nodes(graph);
+			FillContext context(nodes, options, pool, pluginProgress);
+			const bool cached = !this->mapped && this->series.empty() && this->cache_memory > 0 && this->sampling.isWhole(this->info.size)
+			                    && computeSlabDepth(this->info, this->streaming_memory) >= this->info.size[2];
+
+			this->statistics.start(cached ? "decode" : "load");
+
+			// Stopping keeps the slabs loaded so far. Cancelling fails, and Tulip restores
+			// the properties (it saves the state of the graph before running an algorithm).
+			try {
+				if(!this->series.empty()) {
+					fillFromSeries(this->series, this->info, properties, context);
+				} else if(this->mapped) {
+					MappedPropertyVisitor filler(this->mappable, mappedSlabDepth(this->mappable, this->streaming_memory), properties, context);
+					dispatchComponentType(this->mappable.info.componentType, filler);
+				} else if(cached) {
+					itk::DataObject::Pointer image = readCachedImage(this->file, this->info.componentType, this->cache_memory);
+					this->statistics.start("load");
+					FillPropertyVisitor filler(image, properties, context);
+					dispatchComponentType(this->info.componentType, filler);
+				} else {
+					StreamPropertyVisitor filler(this->file, computeSlabDepth(this->info, this->streaming_memory), properties, context);
+					dispatchComponentType(this->info.componentType, filler);
+				}
+			} catch(ProgressInterruption &ex) {
+				if(ex.state != tlp::TLP_STOP)
+					throw;
+			}
+
+			if(context.decoding.GetNumberOfStops() > 0)
+				this->statistics.detail("decode", context.decoding.GetTotal());
+			this->statistics.stop(graph->numberOfNodes());
+
+			if(options.statistics != NULL)
+				value_statistics.store(graph, "image3d_" + this->property->getName());
+
+			if(this->cache_memory > 0)
+				storeCacheStatistics(graph);
+
+			this->statistics.store(graph, "Load image data", this->statistics_log);
 		} catch(std::runtime_error &ex) {
 			if(pluginProgress)
 				pluginProgress->setError(ex.what());
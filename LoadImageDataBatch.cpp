@@ -0,0 +1,277 @@
+#include <tulip/TulipPluginHeaders.h>
+
+#include "PluginUtils.h"
+#include "ImageIOUtils.h"
+#include "GraphFillingFunctions2.h"
+#include "PendingImage.h"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+const char* paramHelp[] = {
+	// 0 Images
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "String")
+		HTML_HELP_BODY()
+		"The images to load and the properties where their data will be stored, as a list of "
+		"&lt;file&gt;=&lt;property&gt; pairs separated by semicolons (e.g. /data/t1.mha=t1;/data/t2.mha=t2). "
+		"The properties must exist, and be of one of the types supported by the \"Load image data\" plugin."
+		HTML_HELP_CLOSE(),
+
+	// 1 Convert to grayscale
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Boolean")
+		HTML_HELP_DEF("Default", "false")
+		HTML_HELP_BODY()
+		"Indicates if the color should be converted to grayscale."
+		HTML_HELP_CLOSE(),
+
+	// 2 Streaming memory
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Maximum amount of memory (in MB) used to hold each decoded image. See the \"Load image data\" plugin. "
+		"Streamed images are decoded while their properties are filled, not in the background."
+		HTML_HELP_CLOSE(),
+
+	// 3 Threads
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "0")
+		HTML_HELP_BODY()
+		"Number of threads used to convert the pixels. 0 uses one thread per core."
+		HTML_HELP_CLOSE(),
+
+	// 4 Decoder threads
+	HTML_HELP_OPEN()
+		HTML_HELP_DEF("Type", "Unsigned int")
+		HTML_HELP_DEF("Default", "1")
+		HTML_HELP_BODY()
+		"Number of images decoded in the background while the properties are filled. "
+		"At most this number of images, plus the one being loaded, are held in memory: each extra thread costs one decoded image. "
+		"0 uses one thread per core."
+		HTML_HELP_CLOSE(),
+};
+
+struct BatchEntry
+{
+	std::string file;
+	tlp::PropertyInterface *property;
+	ImageInformation info;
+	bool mapped;
+	MappableMetaImage mappable;
+};
+}
+
+class LoadImageDataBatch: public tlp::Algorithm {
+private:
+	std::vector< BatchEntry > entries;
+	ImageSampling sampling;
+	bool convert_to_grayscale;
+	unsigned int streaming_memory;
+	unsigned int threads;
+	unsigned int decoder_threads;
+
+	/**
+	 * Waits for the background decodings and releases the decoded images that
+	 * have not been loaded.
+	 */
+	static void releasePending(QThreadPool &decoders, std::vector< PendingImage* > &pending)
+	{
+		decoders.waitForDone();
+		for(uint64_t i = 0; i < pending.size(); ++i) {
+			delete pending[i];
+			pending[i] = NULL;
+		}
+	}
+
+	bool isDecodedInBackground(const BatchEntry &entry) const
+	{
+		return !entry.mapped && this->sampling.isWhole(entry.info.size) && computeSlabDepth(entry.info, this->streaming_memory) >= entry.info.size[2];
+	}
+
+public:
+	PLUGININFORMATIONS("Load image data batch", "Cyrille FAUCHEUX", "2013-08-18", "", "1.0", "Image")
+
+	LoadImageDataBatch(const tlp::PluginContext *context):
+		tlp::Algorithm(context)
+	{
+		addInParameter< std::string >  ("Images",               paramHelp[0], "");
+		addInParameter< bool >         ("Convert to grayscale", paramHelp[1], "false", false);
+		addInParameter< unsigned int > ("Streaming memory",     paramHelp[2], "0", false);
+		addInParameter< unsigned int > ("Threads",              paramHelp[3], "0", false);
+		addInParameter< unsigned int > ("Decoder threads",      paramHelp[4], "1", false);
+	}
+
+	~LoadImageDataBatch() {}
+
+	bool check(std::string &err) {
+		try {
+			if(dataSet == NULL)
+				throw std::runtime_error("No dataset provided.");
+
+			std::string images;
+			CHECK_PROP_PROVIDED("Images", images);
+
+			this->convert_to_grayscale = false;
+			dataSet->get("Convert to grayscale", this->convert_to_grayscale);
+
+			this->streaming_memory = 0;
+			dataSet->get("Streaming memory", this->streaming_memory);
+
+			this->threads = 0;
+			dataSet->get("Threads", this->threads);
+
+			this->decoder_threads = 1;
+			dataSet->get("Decoder threads", this->decoder_threads);
+
+			int width = 0, height = 0, depth = 0;
+			getGridDimensions(graph, width, height, depth);
+
+			// The images are loaded with the region and stride the graph has been imported with.
+			this->sampling = readSampling(graph);
+
+			// All the headers are validated before anything is decoded.
+			this->entries.clear();
+			std::istringstream list(images);
+			std::string pair;
+			while(std::getline(list, pair, ';')) {
+				if(trim(pair).empty())
+					continue;
+
+				const std::string::size_type equal = pair.find_last_of('=');
+				if(equal == std::string::npos) {
+					std::stringstream e; e << "\"" << trim(pair) << "\" is not a <file>=<property> pair";
+					throw std::runtime_error(e.str());
+				}
+
+				BatchEntry entry;
+				entry.file = trim(pair.substr(0, equal));
+				const std::string propertyName = trim(pair.substr(equal + 1));
+
+				if(entry.file.empty() || propertyName.empty()) {
+					std::stringstream e; e << "\"" << trim(pair) << "\" is not a <file>=<property> pair";
+					throw std::runtime_error(e.str());
+				}
+
+				if(!graph->existProperty(propertyName)) {
+					std::stringstream e; e << "The property \"" << propertyName << "\" does not exist";
+					throw std::runtime_error(e.str());
+				}
+				entry.property = graph->getProperty(propertyName);
+
+				if(!(dynamic_cast< tlp::ColorProperty* >(entry.property) || dynamic_cast< tlp::IntegerProperty* >(entry.property) ||
+				     dynamic_cast< tlp::IntegerVectorProperty* >(entry.property) || dynamic_cast< tlp::DoubleProperty* >(entry.property) ||
+				     dynamic_cast< tlp::DoubleVectorProperty* >(entry.property) || dynamic_cast< tlp::BooleanProperty* >(entry.property))) {
+					std::stringstream e; e << "The property \"" << propertyName << "\" must be of one of the following types: "
+					                       << "ColorProperty, IntegerProperty, DoubleProperty, IntegerVectorProperty, DoubleVectorProperty, BooleanProperty.";
+					throw std::runtime_error(e.str());
+				}
+
+				entry.info = readImageInformation(entry.file);
+
+				const ImageSampling resolved = resolveSampling(this->sampling, entry.info.size);
+				if((uint64_t)width != resolved.gridSize(0) || (uint64_t)height != resolved.gridSize(1) || (uint64_t)depth != resolved.gridSize(2)) {
+					std::stringstream e; e << "The dimensions of the graph and the image located at \"" << entry.file << "\" do not match";
+					throw std::runtime_error(e.str());
+				}
+
+				if(dynamic_cast< tlp::ColorProperty* >(entry.property) && (entry.info.numberOfComponents != 1) && (entry.info.numberOfComponents != 3)) {
+					std::stringstream e; e << "To import the image located at \"" << entry.file << "\" as a ColorProperty, it must have either 1 or 3 components per pixel.";
+					throw std::runtime_error(e.str());
+				}
+
+				entry.mapped = readMappableMetaImage(entry.file, entry.mappable);
+				this->entries.push_back(entry);
+			}
+
+			if(this->entries.empty())
+				throw std::runtime_error("The \"Images\" parameter cannot be empty");
+
+		} catch (std::runtime_error &ex) {
+			err.assign(ex.what());
+			return false;
+		}
+
+		return true;
+	}
+
+	bool run() {
+		FillOptions options;
+		options.convert_to_grayscale = this->convert_to_grayscale;
+		options.threads = this->threads;
+		options.sampling = this->sampling;
+
+		QThreadPool pool, decoders;
+		pool.setMaxThreadCount(threadCount(this->threads));
+		decoders.setMaxThreadCount(threadCount(this->decoder_threads));
+
+		// The node set is enumerated once, into the map shared by all the images. Each
+		// image is then loaded by its own pass over the map, as filling all the
+		// properties in one pass would require all the images to be decoded at once.
+		const VoxelNodeMap nodes(graph);
+		FillContext context(nodes, options, pool, pluginProgress);
+
+		std::vector< PendingImage* > pending(this->entries.size(), (PendingImage*)NULL);
+		const uint64_t window = decoders.maxThreadCount();
+		uint64_t next = 0;
+
+		try {
+			for(uint64_t i = 0; i < this->entries.size(); ++i) {
+				// Keeps the decoders busy with the next images while this one is loaded.
+				for(; next < this->entries.size() && next <= i + window; ++next) {
+					if(isDecodedInBackground(this->entries[next])) {
+						pending[next] = new PendingImage();
+						pending[next]->start(decoders, this->entries[next].file, this->entries[next].info.componentType);
+					}
+				}
+
+				const BatchEntry &entry = this->entries[i];
+				std::vector< tlp::PropertyInterface* > properties(1, entry.property);
+
+				if(pluginProgress) {
+					std::stringstream comment; comment << "Loading image " << (i + 1) << "/" << this->entries.size() << ": " << entry.file;
+					pluginProgress->setComment(comment.str());
+				}
+
+				if(entry.mapped) {
+					MappedPropertyVisitor filler(entry.mappable, mappedSlabDepth(entry.mappable, this->streaming_memory), properties, context);
+					dispatchComponentType(entry.mappable.info.componentType, filler);
+				} else if(pending[i] != NULL) {
+					itk::DataObject::Pointer image = pending[i]->wait();
+					FillPropertyVisitor filler(image, properties, context);
+					dispatchComponentType(entry.info.componentType, filler);
+				} else {
+					StreamPropertyVisitor filler(entry.file, computeSlabDepth(entry.info, this->streaming_memory), properties, context);
+					dispatchComponentType(entry.info.componentType, filler);
+				}
+
+				delete pending[i];
+				pending[i] = NULL;
+			}
+		} catch(ProgressInterruption &ex) {
+			releasePending(decoders, pending);
+
+			// Stopping keeps the images loaded so far, cancelling fails and Tulip
+			// restores the properties.
+			if(ex.state == tlp::TLP_STOP)
+				return true;
+
+			if(pluginProgress)
+				pluginProgress->setError(ex.what());
+			return false;
+		} catch(std::runtime_error &ex) {
+			releasePending(decoders, pending);
+
+			if(pluginProgress)
+				pluginProgress->setError(ex.what());
+			return false;
+		}
+
+		return true;
+	}
+};
+
+PLUGIN(LoadImageDataBatch);
@@ -0,0 +1,403 @@
+#ifndef METAIMAGEUTILS_H
+#define METAIMAGEUTILS_H
+
+#include <itkVectorImage.h>
+
+#include <QFile>
+#include <QString>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+
+#include "ImageIOUtils.h"
+#include "ProgressUtils.h"
+#include "ThreadPoolUtils.h"
+#include "VoxelNodeMap.h"
+
+/*
+ * Native support of uncompressed MetaImage files: a text header followed by
+ * the raw voxel values, either in the same file (.mha) or in a separate file
+ * (.mhd + .raw).
+ */
+
+template <typename TValue> struct MetaElementType;
+template <> struct MetaElementType< unsigned char >  { static const char* name() { return "MET_UCHAR"; } };
+template <> struct MetaElementType< unsigned short > { static const char* name() { return "MET_USHORT"; } };
+template <> struct MetaElementType< short >          { static const char* name() { return "MET_SHORT"; } };
+template <> struct MetaElementType< int >            { static const char* name() { return "MET_INT"; } };
+template <> struct MetaElementType< float >          { static const char* name() { return "MET_FLOAT"; } };
+template <> struct MetaElementType< double >         { static const char* name() { return "MET_DOUBLE"; } };
+
+inline bool hasSuffix(const std::string &file, const std::string &suffix)
+{
+	if(file.size() < suffix.size())
+		return false;
+
+	std::string end = file.substr(file.size() - suffix.size());
+	std::transform(end.begin(), end.end(), end.begin(), ::tolower);
+	return end == suffix;
+}
+
+inline bool isMetaImageFile(const std::string &file)
+{
+	return hasSuffix(file, ".mha") || hasSuffix(file, ".mhd");
+}
+
+inline bool isHostBigEndian()
+{
+	const unsigned short one = 1;
+	return *reinterpret_cast< const unsigned char* >(&one) == 0;
+}
+
+/**
+ * Size (in MB) of the window of the data file mapped at once when reading a
+ * MetaImage without memory budget.
+ */
+const unsigned int MAPPED_WINDOW_SIZE = 256;
+
+/**
+ * Location of the voxel values of an uncompressed MetaImage.
+ */
+struct MappableMetaImage
+{
+	ImageInformation info;
+	std::string dataFile;
+	qint64 dataOffset;
+	// Value of the "SourceStamp" field, written in the disk cache files.
+	std::string sourceStamp;
+};
+
+inline std::string trim(const std::string &s)
+{
+	const std::string::size_type begin = s.find_first_not_of(" \t\r\n");
+	if(begin == std::string::npos)
+		return "";
+	return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+/**
+ * Parses a boolean field of a MetaImage header, case insensitively as MetaIO
+ * does. Returns false when the value is neither true nor false.
+ */
+inline bool metaBoolean(const std::string &value, bool &result)
+{
+	std::string lower = value;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	if(lower == "true")
+		result = true;
+	else if(lower == "false")
+		result = false;
+	else
+		return false;
+	return true;
+}
+
+inline bool metaElementType(const std::string &type, itk::ImageIOBase::IOComponentType &componentType, unsigned int &componentSize)
+{
+	if(type == "MET_UCHAR")       { componentType = itk::ImageIOBase::UCHAR;  componentSize = sizeof(unsigned char); }
+	else if(type == "MET_USHORT") { componentType = itk::ImageIOBase::USHORT; componentSize = sizeof(unsigned short); }
+	else if(type == "MET_SHORT")  { componentType = itk::ImageIOBase::SHORT;  componentSize = sizeof(short); }
+	else if(type == "MET_INT")    { componentType = itk::ImageIOBase::INT;    componentSize = sizeof(int); }
+	else if(type == "MET_FLOAT")  { componentType = itk::ImageIOBase::FLOAT;  componentSize = sizeof(float); }
+	else if(type == "MET_DOUBLE") { componentType = itk::ImageIOBase::DOUBLE; componentSize = sizeof(double); }
+	else return false;
+	return true;
+}
+
+/**
+ * Reads the header of a MetaImage file and tells if its voxel values can be
+ * mapped in memory as is: binary, uncompressed, in the byte order of the
+ * host, stored in a single data file, and of a component type handled by
+ * dispatchComponentType. The values must also start at an offset aligned on
+ * the size of a component, as they are read in place once mapped. Any field
+ * whose value is not understood makes the image not mappable, it is then
+ * read by ITK.
+ */
+inline bool readMappableMetaImage(const std::string &file, MappableMetaImage &image)
+{
+	if(!isMetaImageFile(file))
+		return false;
+
+	std::ifstream header(file.c_str(), std::ios::in | std::ios::binary);
+	if(!header)
+		return false;
+
+	unsigned int dimensions = 0;
+	int64_t headerSize = 0;
+	bool binary = false, msb = false, compressed = false, typeFound = false, valid = true;
+	image.info.numberOfComponents = 1;
+	image.info.canStreamRead = true;
+	image.info.size[0] = image.info.size[1] = image.info.size[2] = 1;
+	image.dataFile.clear();
+	image.sourceStamp.clear();
+
+	std::string line;
+	while(std::getline(header, line)) {
+		const std::string::size_type equal = line.find('=');
+		if(equal == std::string::npos)
+			continue;
+
+		const std::string key = trim(line.substr(0, equal));
+		const std::string value = trim(line.substr(equal + 1));
+		std::istringstream values(value);
+
+		if(key == "NDims") {
+			values >> dimensions;
+		} else if(key == "DimSize") {
+			for(unsigned int i = 0; i < dimensions && i < 3; ++i)
+				values >> image.info.size[i];
+		} else if(key == "BinaryData") {
+			valid = valid && metaBoolean(value, binary);
+		} else if(key == "BinaryDataByteOrderMSB" || key == "ElementByteOrderMSB") {
+			valid = valid && metaBoolean(value, msb);
+		} else if(key == "CompressedData") {
+			valid = valid && metaBoolean(value, compressed);
+		} else if(key == "ElementNumberOfChannels") {
+			values >> image.info.numberOfComponents;
+		} else if(key == "ElementType") {
+			typeFound = metaElementType(value, image.info.componentType, image.info.componentSize);
+		} else if(key == "HeaderSize") {
+			values >> headerSize;
+		} else if(key == "SourceStamp") {
+			image.sourceStamp = value;
+		} else if(key == "ElementDataFile") {
+			// Always the last field of the header.
+			if(value == "LOCAL") {
+				image.dataFile = file;
+				image.dataOffset = header.tellg();
+			} else if(value != "LIST" && value.find('%') == std::string::npos && value.find(' ') == std::string::npos) {
+				const std::string::size_type slash = file.find_last_of("/\\");
+				image.dataFile = (slash == std::string::npos || value[0] == '/') ? value : file.substr(0, slash + 1) + value;
+				image.dataOffset = headerSize > 0 ? headerSize : 0;
+			}
+			break;
+		}
+	}
+
+	if(!valid || dimensions < 2 || dimensions > 3 || !binary || compressed || msb != isHostBigEndian() || !typeFound || image.dataFile.empty())
+		return false;
+
+	const qint64 dataSize = (qint64)image.info.size[0] * image.info.size[1] * image.info.size[2] * image.info.numberOfComponents * image.info.componentSize;
+	const qint64 fileSize = QFile(QString::fromStdString(image.dataFile)).size();
+	if(headerSize == -1 && image.dataFile != file)
+		image.dataOffset = fileSize - dataSize;
+
+	return image.dataOffset >= 0 && image.dataOffset % image.info.componentSize == 0 && fileSize >= image.dataOffset + dataSize;
+}
+
+/**
+ * Reads a mappable MetaImage slab by slab, like SlabReader, but without
+ * decoding: each slab is an image whose buffer is a window of the data file
+ * mapped in memory, so its pages are only read when touched. The window of
+ * the previous slab is unmapped when moving to the next one. Only the slices
+ * of the region of the sampling are mapped.
+ */
+template <typename TPixel>
+class MappedSlabReader
+{
+public:
+	typedef itk::VectorImage< TPixel, 3 > ImageType;
+
+private:
+	const MappableMetaImage &source;
+	const uint64_t slabDepth;
+	QFile file;
+	uchar *window;
+	ImageSampling sampling;
+	uint64_t nextSlice;
+	typename ImageType::Pointer slab;
+	typename ImageType::RegionType largestRegion, slabRegion;
+
+	void unmap()
+	{
+		if(window != NULL) {
+			slab = NULL;
+			file.unmap(window);
+			window = NULL;
+		}
+	}
+
+public:
+	MappedSlabReader(const MappableMetaImage &source, const uint64_t slabDepth, const ImageSampling &sampling = ImageSampling()) :
+		source(source), slabDepth(slabDepth), file(QString::fromStdString(source.dataFile)), window(NULL),
+		sampling(resolveSampling(sampling, source.info.size)), nextSlice(this->sampling.index[2])
+	{
+		if(!file.open(QIODevice::ReadOnly)) {
+			std::stringstream e; e << "The image located at \"" << source.dataFile << "\" is not readable";
+			throw std::runtime_error(e.str());
+		}
+
+		typename ImageType::IndexType origin = {{0, 0, 0}};
+		typename ImageType::SizeType size;
+		size[0] = source.info.size[0]; size[1] = source.info.size[1]; size[2] = source.info.size[2];
+		largestRegion = typename ImageType::RegionType(origin, size);
+	}
+
+	~MappedSlabReader()
+	{
+		unmap();
+	}
+
+	const typename ImageType::RegionType& largestPossibleRegion() const { return largestRegion; }
+
+	bool next()
+	{
+		unmap();
+
+		const uint64_t end = sampling.index[2] + sampling.size[2];
+		if(nextSlice >= end)
+			return false;
+
+		const uint64_t depth = std::min(slabDepth, end - nextSlice);
+		const qint64 sliceValues = (qint64)source.info.size[0] * source.info.size[1] * source.info.numberOfComponents;
+
+		window = file.map(source.dataOffset + nextSlice * sliceValues * sizeof(TPixel), depth * sliceValues * sizeof(TPixel));
+		if(window == NULL) {
+			std::stringstream e; e << "Unable to map the image located at \"" << source.dataFile << "\"";
+			throw std::runtime_error(e.str());
+		}
+
+		slabRegion = largestRegion;
+		slabRegion.SetIndex(2, nextSlice);
+		slabRegion.SetSize(2, depth);
+
+		slab = ImageType::New();
+		slab->SetNumberOfComponentsPerPixel(source.info.numberOfComponents);
+		slab->SetLargestPossibleRegion(largestRegion);
+		slab->SetBufferedRegion(slabRegion);
+		slab->SetRequestedRegion(slabRegion);
+		// The image does not own the mapped memory, and only reads it.
+		slab->GetPixelContainer()->SetImportPointer(reinterpret_cast< TPixel* >(window), depth * sliceValues, false);
+
+		nextSlice = sampling.nextSample(2, nextSlice + depth);
+		return true;
+	}
+
+	ImageType* image() const { return slab; }
+	const typename ImageType::RegionType& region() const { return slabRegion; }
+};
+
+/**
+ * Header of an uncompressed MetaImage in the byte order of the host.
+ * The extra fields (one "Key = Value" per line) are written before
+ * ElementDataFile, which must be the last one.
+ */
+template <typename TValue>
+std::string formatMetaImageHeader(const uint64_t width, const uint64_t height, const uint64_t depth, const unsigned int numberOfChannels,
+                                  const std::string &dataFile, const std::string &extraFields = "")
+{
+	std::ostringstream header;
+	header << "ObjectType = Image\n"
+	       << "NDims = 3\n"
+	       << "BinaryData = True\n"
+	       << "BinaryDataByteOrderMSB = " << (isHostBigEndian() ? "True" : "False") << "\n"
+	       << "CompressedData = False\n"
+	       << "DimSize = " << width << " " << height << " " << depth << "\n";
+	if(numberOfChannels > 1)
+		header << "ElementNumberOfChannels = " << numberOfChannels << "\n";
+	header << "ElementSpacing = 1 1 1\n"
+	       << "ElementType = " << MetaElementType< TValue >::name() << "\n"
+	       << extraFields
+	       << "ElementDataFile = " << dataFile << "\n";
+	return header.str();
+}
+
+/**
+ * Fills the values of a range of slices of a mapped window of the output,
+ * which starts at slice firstSlice.
+ */
+template <typename TValue, typename TConverter>
+class WriteSlicesTask
+{
+private:
+	const VoxelNodeMap &nodes;
+	const uint64_t sliceSize;
+	const unsigned int numberOfChannels;
+	const TConverter &converter;
+	TValue *data;
+	const uint64_t firstSlice;
+
+public:
+	WriteSlicesTask(const VoxelNodeMap &nodes, const uint64_t sliceSize, const unsigned int numberOfChannels, const TConverter &converter, TValue *data, const uint64_t firstSlice) :
+		nodes(nodes), sliceSize(sliceSize), numberOfChannels(numberOfChannels), converter(converter), data(data), firstSlice(firstSlice)
+	{}
+
+	void operator()(const uint64_t begin, const uint64_t end) const
+	{
+		TValue *out = data + (begin - firstSlice) * sliceSize * numberOfChannels;
+		for(uint64_t voxel = begin * sliceSize; voxel < end * sliceSize; ++voxel, out += numberOfChannels) {
+			// Voxels without a node, in a sparse grid, are written as 0.
+			const tlp::node n = nodes[voxel];
+			if(n.isValid())
+				converter(n, out);
+			else
+				std::fill(out, out + numberOfChannels, TValue(0));
+		}
+	}
+};
+
+/**
+ * Writes the nodes of a width x height x depth grid in an uncompressed
+ * MetaImage file (.mha or .mhd), with numberOfChannels values of type TValue
+ * per voxel.
+ *
+ * The values are written by converter(node, TValue *values) straight into
+ * the memory mapped data file, no intermediate image is allocated. The file
+ * is mapped a window of slices at a time (of about MAPPED_WINDOW_SIZE MB), so
+ * the size of the volume is not bound by the address space. Slices are
+ * converted in parallel, the converter must be safe to call concurrently and
+ * must not throw.
+ */
+template <typename TValue, typename TConverter>
+void writeMetaImage(const std::string &file, const VoxelNodeMap &nodes, const uint64_t width, const uint64_t height, const uint64_t depth,
+                    const unsigned int numberOfChannels, const TConverter &converter, QThreadPool &pool, tlp::PluginProgress *pluginProgress = NULL)
+{
+	const bool local = hasSuffix(file, ".mha");
+	std::string dataFile = file;
+	if(!local)
+		dataFile = file.substr(0, file.size() - 4) + ".raw";
+
+	const std::string headerText = formatMetaImageHeader< TValue >(width, height, depth, numberOfChannels,
+	                                                               local ? std::string("LOCAL") : dataFile.substr(dataFile.find_last_of("/\\") + 1));
+
+	QFile headerFile(QString::fromStdString(file));
+	if(!headerFile.open(QIODevice::ReadWrite | QIODevice::Truncate) || headerFile.write(headerText.data(), headerText.size()) != (qint64)headerText.size())
+		throw std::runtime_error("Unable to write \"" + file + "\"");
+
+	QFile rawFile(QString::fromStdString(dataFile));
+	QFile &output = local ? headerFile : rawFile;
+	const qint64 offset = local ? headerText.size() : 0;
+	if(!local && !rawFile.open(QIODevice::ReadWrite | QIODevice::Truncate))
+		throw std::runtime_error("Unable to write \"" + dataFile + "\"");
+
+	const uint64_t sliceSize = width * height;
+	const qint64 dataSize = (qint64)sliceSize * depth * numberOfChannels * sizeof(TValue);
+	if(dataSize == 0)
+		return;
+
+	if(!output.resize(offset + dataSize))
+		throw std::runtime_error("Unable to allocate \"" + dataFile + "\"");
+
+	const qint64 sliceBytes = (qint64)sliceSize * numberOfChannels * sizeof(TValue);
+	const uint64_t slicesPerWindow = std::max< qint64 >(std::max(1, pool.maxThreadCount()), (MAPPED_WINDOW_SIZE * 1024LL * 1024LL) / sliceBytes);
+	ProgressReporter progress(pluginProgress);
+	for(uint64_t z = 0; z < depth; z += slicesPerWindow) {
+		const uint64_t windowDepth = std::min(slicesPerWindow, depth - z);
+
+		uchar *mapped = output.map(offset + z * sliceBytes, windowDepth * sliceBytes);
+		if(mapped == NULL)
+			throw std::runtime_error("Unable to map \"" + dataFile + "\"");
+
+		parallelFor(pool, z, z + windowDepth, WriteSlicesTask< TValue, TConverter >(nodes, sliceSize, numberOfChannels, converter, reinterpret_cast< TValue* >(mapped), z));
+		output.unmap(mapped);
+
+		progress.update(z + windowDepth, depth);
+	}
+}
+
+#endif /* METAIMAGEUTILS_H */
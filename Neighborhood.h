@@ -0,0 +1,124 @@
+#ifndef NEIGHBORHOOD_H
+#define NEIGHBORHOOD_H
+
+#include <cmath>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Offsets of the neighbors of a voxel, for a Circular (euclidean distance) or
+ * Square (chessboard distance) neighborhood of a given radius.
+ *
+ * The "forward" half of the neighborhood (the offsets leading to a voxel with
+ * a greater linear index) enumerates each pair of neighbors once, which is
+ * what is needed to create the edges. The full neighborhood is used to find
+ * the neighbors of a voxel.
+ */
+class NeighborhoodStencil
+{
+public:
+	enum neighborhood_t { CIRCULAR, SQUARE };
+
+	struct Offset { int dx, dy, dz; };
+
+private:
+	neighborhood_t neighborhoodType;
+	double neighborhoodRadius;
+	std::vector< Offset > offsets, allOffsets;
+
+public:
+	NeighborhoodStencil(const neighborhood_t type, const double radius) :
+		neighborhoodType(type), neighborhoodRadius(radius)
+	{
+		const int r = (int)std::floor(radius);
+		for(int dz = 0; dz <= r; ++dz) {
+			for(int dy = -r; dy <= r; ++dy) {
+				for(int dx = -r; dx <= r; ++dx) {
+					if(dz == 0 && (dy < 0 || (dy == 0 && dx <= 0)))
+						continue;
+
+					if(type == CIRCULAR && dx * dx + dy * dy + dz * dz > radius * radius)
+						continue;
+
+					Offset o = { dx, dy, dz };
+					offsets.push_back(o);
+				}
+			}
+		}
+
+		allOffsets = offsets;
+		for(std::vector< Offset >::const_iterator it = offsets.begin(); it != offsets.end(); ++it) {
+			Offset o = { -it->dx, -it->dy, -it->dz };
+			allOffsets.push_back(o);
+		}
+	}
+
+	static neighborhood_t parseType(const std::string &type)
+	{
+		if(type.compare("Circular") == 0)
+			return CIRCULAR;
+		if(type.compare("Square") == 0)
+			return SQUARE;
+		throw std::runtime_error("Unknown neighborhood type.");
+	}
+
+	static std::string typeName(const neighborhood_t type)
+	{
+		return type == CIRCULAR ? "Circular" : "Square";
+	}
+
+	neighborhood_t type() const { return neighborhoodType; }
+	double radius() const { return neighborhoodRadius; }
+
+	const std::vector< Offset >& forwardOffsets() const { return offsets; }
+	const std::vector< Offset >& neighborOffsets() const { return allOffsets; }
+};
+
+/**
+ * Enumerates the linear indexes of the neighbors of a voxel inside a
+ * width x height x depth grid, computed from the stencil on demand.
+ *
+ *   VoxelNeighborIterator it(stencil, width, height, depth, voxel);
+ *   while(it.hasNext()) { uint64_t neighbor = it.next(); ... }
+ */
+class VoxelNeighborIterator
+{
+private:
+	const std::vector< NeighborhoodStencil::Offset > &offsets;
+	const int64_t width, height, depth;
+	int64_t x, y, z;
+	std::vector< NeighborhoodStencil::Offset >::const_iterator current;
+
+	void skipOutside()
+	{
+		while(current != offsets.end()) {
+			const int64_t nx = x + current->dx, ny = y + current->dy, nz = z + current->dz;
+			if(nx >= 0 && nx < width && ny >= 0 && ny < height && nz >= 0 && nz < depth)
+				return;
+			++current;
+		}
+	}
+
+public:
+	VoxelNeighborIterator(const NeighborhoodStencil &stencil, const int64_t width, const int64_t height, const int64_t depth, const uint64_t voxel) :
+		offsets(stencil.neighborOffsets()), width(width), height(height), depth(depth),
+		x(voxel % width), y((voxel / width) % height), z(voxel / (width * height)),
+		current(offsets.begin())
+	{
+		skipOutside();
+	}
+
+	bool hasNext() const { return current != offsets.end(); }
+
+	uint64_t next()
+	{
+		const uint64_t neighbor = (x + current->dx) + ((y + current->dy) + (z + current->dz) * height) * width;
+		++current;
+		skipOutside();
+		return neighbor;
+	}
+};
+
+#endif /* NEIGHBORHOOD_H */
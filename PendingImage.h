@@ -0,0 +1,100 @@
+#ifndef PENDINGIMAGE_H
+#define PENDINGIMAGE_H
+
+#include <itkDataObject.h>
+#include <itkImageIOBase.h>
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <stdexcept>
+#include <string>
+
+#include "ImageIOUtils.h"
+
+/**
+ * An image decoded in the background by a thread pool, like ReadImageVisitor.
+ *
+ *   PendingImage pending;
+ *   pending.start(pool, file, componentType);
+ *   ...
+ *   itk::DataObject::Pointer image = pending.wait();
+ *
+ * The pending image must outlive its decoding (wait() for it, or for the
+ * pool to be done).
+ */
+class PendingImage
+{
+private:
+	QMutex mutex;
+	QWaitCondition decoded;
+	bool done;
+	itk::DataObject::Pointer image;
+	std::string error;
+
+	class DecodeTask : public QRunnable
+	{
+	private:
+		PendingImage &pending;
+		const std::string file;
+		const itk::ImageIOBase::IOComponentType componentType;
+
+	public:
+		DecodeTask(PendingImage &pending, const std::string &file, const itk::ImageIOBase::IOComponentType componentType) :
+			pending(pending), file(file), componentType(componentType)
+		{}
+
+		void run()
+		{
+			itk::DataObject::Pointer image;
+			std::string error;
+			try {
+				ReadImageVisitor reader(file);
+				dispatchComponentType(componentType, reader);
+				image = reader.image;
+			} catch(std::runtime_error &ex) {
+				error = ex.what();
+			}
+
+			QMutexLocker locker(&pending.mutex);
+			pending.image = image;
+			pending.error = error;
+			pending.done = true;
+			pending.decoded.wakeAll();
+		}
+	};
+
+	PendingImage(const PendingImage&);
+	PendingImage& operator=(const PendingImage&);
+
+public:
+	PendingImage() : done(false) {}
+
+	void start(QThreadPool &pool, const std::string &file, const itk::ImageIOBase::IOComponentType componentType)
+	{
+		pool.start(new DecodeTask(*this, file, componentType));
+	}
+
+	/**
+	 * Waits for the image to be decoded and returns it, then forgets it.
+	 * Throws the decoding error, if any.
+	 */
+	itk::DataObject::Pointer wait()
+	{
+		QMutexLocker locker(&mutex);
+		while(!done)
+			decoded.wait(&mutex);
+
+		if(!error.empty())
+			throw std::runtime_error(error);
+
+		itk::DataObject::Pointer result = image;
+		image = NULL;
+		return result;
+	}
+};
+
+#endif /* PENDINGIMAGE_H */
@@ -0,0 +1,148 @@
+#ifndef PHASESTATISTICS_H
+#define PHASESTATISTICS_H
+
+#include <tulip/Graph.h>
+#include <tulip/TlpTools.h>
+
+#include <itkTimeProbe.h>
+#include <itkMemoryProbe.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Name of the graph attribute holding the statistics of the last run of one
+ * of the plugins.
+ */
+const char* const STATISTICS_ATTRIBUTE = "image3d_stats";
+
+/**
+ * Measures the successive phases of a run of a plugin (e.g. reading the image
+ * information, building the grid, filling the properties): the wall time, the
+ * number of voxels processed and the memory allocated, i.e. the growth of the
+ * memory usage of the process (itk::MemoryProbe, in kB) during the phase.
+ * The probes are only read when a phase starts or stops, the cost is
+ * negligible.
+ *
+ * A phase can be detailed by the time spent in one of its steps (e.g. the
+ * decoding of the slabs of an image, interleaved with the filling of the
+ * properties), measured by the caller.
+ */
+class PhaseStatistics
+{
+private:
+	struct Phase
+	{
+		std::string name;
+		double seconds;
+		unsigned long long voxels;
+		double memory;
+		bool detail;
+	};
+
+	std::vector< Phase > phases;
+	std::vector< Phase > details;
+	itk::TimeProbe timeProbe;
+	itk::MemoryProbe memoryProbe;
+	std::string current;
+
+public:
+	void clear()
+	{
+		phases.clear();
+		details.clear();
+		current.clear();
+	}
+
+	/**
+	 * Starts a phase, stopping the current one (with no voxels processed).
+	 */
+	void start(const std::string &name)
+	{
+		if(!current.empty())
+			stop(0);
+
+		current = name;
+		timeProbe.Reset();
+		memoryProbe.Reset();
+		memoryProbe.Start();
+		timeProbe.Start();
+	}
+
+	void stop(const unsigned long long voxels)
+	{
+		if(current.empty())
+			return;
+
+		timeProbe.Stop();
+		memoryProbe.Stop();
+
+		Phase phase;
+		phase.name = current;
+		phase.seconds = timeProbe.GetTotal();
+		phase.voxels = voxels;
+		phase.memory = memoryProbe.GetTotal();
+		phase.detail = false;
+		phases.push_back(phase);
+
+		phases.insert(phases.end(), details.begin(), details.end());
+		details.clear();
+		current.clear();
+	}
+
+	/**
+	 * Time spent in a step of the current phase.
+	 */
+	void detail(const std::string &name, const double seconds)
+	{
+		Phase phase;
+		phase.name = name;
+		phase.seconds = seconds;
+		phase.voxels = 0;
+		phase.memory = 0;
+		phase.detail = true;
+		details.push_back(phase);
+	}
+
+	/**
+	 * One line per phase, followed by the total:
+	 * "<phase>: <seconds> s, <voxels> voxels, <memory> kB", the details of a
+	 * phase being indented below it: "  <step>: <seconds> s".
+	 */
+	std::string toString() const
+	{
+		std::ostringstream out;
+		double seconds = 0, memory = 0;
+		for(unsigned int i = 0; i < phases.size(); ++i) {
+			if(phases[i].detail) {
+				out << "  " << phases[i].name << ": " << phases[i].seconds << " s" << std::endl;
+				continue;
+			}
+
+			out << phases[i].name << ": " << phases[i].seconds << " s, " << phases[i].voxels << " voxels, " << phases[i].memory << " kB" << std::endl;
+			seconds += phases[i].seconds;
+			memory += phases[i].memory;
+		}
+		out << "total: " << seconds << " s, " << memory << " kB";
+		return out.str();
+	}
+
+	/**
+	 * Stops the current phase and stores the statistics in the
+	 * image3d_stats graph attribute, replacing the ones of the previous run.
+	 * They are also written to the debug output of Tulip when log is true.
+	 */
+	void store(tlp::Graph *graph, const std::string &pluginName, const bool log)
+	{
+		stop(0);
+
+		const std::string statistics = toString();
+		graph->setAttribute< std::string >(STATISTICS_ATTRIBUTE, pluginName + "\n" + statistics);
+
+		if(log)
+			tlp::debug() << pluginName << " statistics:" << std::endl << statistics << std::endl;
+	}
+};
+
+#endif /* PHASESTATISTICS_H */
@@ -0,0 +1,85 @@
+#ifndef PROGRESSUTILS_H
+#define PROGRESSUTILS_H
+
+#include <QElapsedTimer>
+
+#include <climits>
+#include <stdexcept>
+
+/**
+ * Minimum time (in ms) between two reports of a ProgressReporter.
+ */
+const int PROGRESS_INTERVAL = 100;
+
+/**
+ * Reports the progress of a loop over done of total elements. PluginProgress
+ * takes int steps, so counts beyond INT_MAX (e.g. voxels of large volumes)
+ * are scaled down instead of overflowing.
+ */
+inline tlp::ProgressState reportProgress(tlp::PluginProgress *pluginProgress, const unsigned long long done, const unsigned long long total)
+{
+	if(pluginProgress == NULL)
+		return tlp::TLP_CONTINUE;
+
+	if(total <= (unsigned long long)INT_MAX)
+		return pluginProgress->progress(done, total);
+
+	const unsigned long long scale = total / INT_MAX + 1;
+	return pluginProgress->progress(done / scale, total / scale);
+}
+
+/**
+ * Thrown when the user cancels or stops a plugin. On TLP_STOP, the plugin
+ * keeps the work done so far when it is usable (e.g. the slabs of an image
+ * already loaded), on TLP_CANCEL it discards it.
+ */
+class ProgressInterruption : public std::runtime_error
+{
+public:
+	const tlp::ProgressState state;
+
+	ProgressInterruption(const tlp::ProgressState state) :
+		std::runtime_error(state == tlp::TLP_STOP ? "Stopped by the user" : "Cancelled by the user"), state(state)
+	{}
+};
+
+/**
+ * Reports the progress of a long loop, at most every PROGRESS_INTERVAL ms as
+ * each report may repaint the progress dialog, and checks whether the user
+ * cancelled or stopped the plugin in between.
+ */
+class ProgressReporter
+{
+private:
+	tlp::PluginProgress *pluginProgress;
+	QElapsedTimer timer;
+
+public:
+	ProgressReporter(tlp::PluginProgress *pluginProgress) :
+		pluginProgress(pluginProgress)
+	{}
+
+	/**
+	 * To be called between chunks of work (e.g. once per slab), where the
+	 * work done so far is consistent. Throws a ProgressInterruption when the
+	 * user cancelled or stopped the plugin.
+	 */
+	void update(const unsigned long long done, const unsigned long long total)
+	{
+		if(pluginProgress == NULL)
+			return;
+
+		tlp::ProgressState state;
+		if(!timer.isValid() || timer.elapsed() >= PROGRESS_INTERVAL || done >= total) {
+			state = reportProgress(pluginProgress, done, total);
+			timer.start();
+		} else {
+			state = pluginProgress->state();
+		}
+
+		if(state != tlp::TLP_CONTINUE)
+			throw ProgressInterruption(state);
+	}
+};
+
+#endif /* PROGRESSUTILS_H */
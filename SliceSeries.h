@@ -0,0 +1,146 @@
+#ifndef SLICESERIES_H
+#define SLICESERIES_H
+
+#include <itkNumericSeriesFileNames.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "GraphFillingFunctions2.h"
+#include "ImageIOUtils.h"
+#include "PendingImage.h"
+
+/*
+ * Volumes stored as a series of 2D slices, one file per slice, named after a
+ * printf-like pattern ("slice_%04d.png") and a range of indexes.
+ */
+
+inline std::vector< std::string > seriesFileNames(const std::string &pattern, const unsigned int start, const unsigned int end)
+{
+	if(end < start)
+		throw std::runtime_error("The end index of the series must not be lower than its start index");
+
+	itk::NumericSeriesFileNames::Pointer filenameGenerator = itk::NumericSeriesFileNames::New();
+	filenameGenerator->SetStartIndex(start);
+	filenameGenerator->SetEndIndex(end);
+	filenameGenerator->SetIncrementIndex(1);
+	filenameGenerator->SetSeriesFormat(pattern);
+	return filenameGenerator->GetFileNames();
+}
+
+/**
+ * Information of the volume, read from the header of the first slice.
+ */
+inline ImageInformation readSeriesInformation(const std::vector< std::string > &files)
+{
+	if(files.empty())
+		throw std::runtime_error("The series is empty");
+
+	ImageInformation info = readImageInformation(files[0]);
+	if(info.size[2] != 1) {
+		std::stringstream e; e << "The image located at \"" << files[0] << "\" is not a 2D image";
+		throw std::runtime_error(e.str());
+	}
+
+	info.size[2] = files.size();
+	info.canStreamRead = false;
+	return info;
+}
+
+/**
+ * Fills the properties with the nodes of the Z-th slice of the volume, from
+ * a decoded slice. Must be dispatched on the same component type as the read.
+ */
+class SliceFillVisitor
+{
+private:
+	itk::DataObject *image;
+	const std::string &file;
+	const ImageInformation &info;
+	const uint64_t z;
+	const std::vector< tlp::PropertyInterface* > &properties;
+	FillContext &context;
+
+public:
+	SliceFillVisitor(itk::DataObject *image, const std::string &file, const ImageInformation &info, const uint64_t z,
+	                 const std::vector< tlp::PropertyInterface* > &properties, FillContext &context) :
+		image(image), file(file), info(info), z(z), properties(properties), context(context)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		typedef itk::VectorImage< TPixel, 3 > ImageType;
+		ImageType *slice = dynamic_cast< ImageType* >(image);
+
+		typename ImageType::RegionType region = slice->GetLargestPossibleRegion();
+		if(region.GetSize(0) != info.size[0] || region.GetSize(1) != info.size[1] || region.GetSize(2) != 1 || slice->GetNumberOfComponentsPerPixel() != info.numberOfComponents) {
+			std::stringstream e; e << "The image located at \"" << file << "\" does not match the first slice of the series";
+			throw std::runtime_error(e.str());
+		}
+
+		// The slice is presented as the Z-th slice of the whole volume.
+		typename ImageType::RegionType largest = region;
+		largest.SetSize(2, info.size[2]);
+		checkNodeCount(context, largest);
+
+		region.SetIndex(2, z);
+		slice->SetLargestPossibleRegion(largest);
+		slice->SetBufferedRegion(region);
+		slice->SetRequestedRegion(region);
+
+		ObserverHolder holder;
+		fillProperties< ImageType >(slice, region, properties, context);
+	}
+};
+
+/**
+ * Fills the properties from a series of slices. The slices are decoded in the
+ * background by as many threads as the pool of the context, while the
+ * previous ones are filled. At most one slice per thread, plus the one being
+ * filled, are held in memory. The slices not kept by the sampling of the
+ * options are not decoded.
+ */
+inline void fillFromSeries(const std::vector< std::string > &files, const ImageInformation &info, const std::vector< tlp::PropertyInterface* > &properties, FillContext &context)
+{
+	const ImageSampling sampling = resolveSampling(context.options.sampling, info.size);
+	std::vector< uint64_t > slices;
+	for(uint64_t z = sampling.index[2]; z < sampling.index[2] + sampling.size[2]; z += sampling.stride[2])
+		slices.push_back(z);
+
+	QThreadPool decoders;
+	decoders.setMaxThreadCount(context.pool.maxThreadCount());
+
+	std::vector< PendingImage* > pending(slices.size(), (PendingImage*)NULL);
+	const uint64_t window = decoders.maxThreadCount();
+	uint64_t next = 0;
+
+	try {
+		for(uint64_t i = 0; i < slices.size(); ++i) {
+			for(; next < slices.size() && next <= i + window; ++next) {
+				pending[next] = new PendingImage();
+				pending[next]->start(decoders, files[slices[next]], info.componentType);
+			}
+
+			const uint64_t z = slices[i];
+			context.decoding.Start();
+			itk::DataObject::Pointer slice = pending[i]->wait();
+			context.decoding.Stop();
+			SliceFillVisitor filler(slice, files[z], info, z, properties, context);
+			dispatchComponentType(info.componentType, filler);
+
+			delete pending[i];
+			pending[i] = NULL;
+		}
+	} catch(std::runtime_error &) {
+		decoders.waitForDone();
+		for(uint64_t i = 0; i < pending.size(); ++i)
+			delete pending[i];
+		throw;
+	}
+}
+
+#endif /* SLICESERIES_H */
@@ -0,0 +1,207 @@
+#ifndef SLICESERIESWRITER_H
+#define SLICESERIESWRITER_H
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ProgressUtils.h"
+#include "ThreadPoolUtils.h"
+#include "VoxelNodeMap.h"
+
+/**
+ * Number of conversions of a pattern of NumericSeriesFileNames (e.g. %d,
+ * %03d or %lu), i.e. 1 when it gives a different file name to each slice.
+ * The pattern is formatted with the index of the slice as only argument, so
+ * -1 is returned when it contains a conversion which is not an integer one
+ * (e.g. %s), as formatting it would be undefined.
+ */
+inline int countSliceIndexes(const std::string &pattern)
+{
+	int count = 0;
+	for(std::string::size_type i = pattern.find('%'); i != std::string::npos; i = pattern.find('%', i)) {
+		++i;
+		if(i < pattern.size() && pattern[i] == '%') {
+			++i;
+			continue;
+		}
+
+		// Flags, width, then length modifiers.
+		i = pattern.find_first_not_of("-+ #0123456789", i);
+		if(i != std::string::npos)
+			i = pattern.find_first_not_of("hljzt", i);
+		if(i == std::string::npos || std::string("diouxX").find(pattern[i]) == std::string::npos)
+			return -1;
+
+		++count;
+		++i;
+	}
+
+	return count;
+}
+
+/**
+ * Set of reusable 2D slice buffers, shared between the thread filling the
+ * slices and the threads encoding them. Also records the first encoding
+ * error.
+ */
+template <typename TSliceType>
+class SliceBuffers
+{
+private:
+	QMutex mutex;
+	QWaitCondition released;
+	std::vector< typename TSliceType::Pointer > available;
+	std::string error;
+
+public:
+	SliceBuffers(const unsigned int numberOfBuffers, const uint64_t width, const uint64_t height)
+	{
+		typename TSliceType::IndexType origin = {{0, 0}};
+		typename TSliceType::SizeType size;
+		size[0] = width; size[1] = height;
+
+		for(unsigned int i = 0; i < numberOfBuffers; ++i) {
+			typename TSliceType::Pointer slice = TSliceType::New();
+			slice->SetRegions(typename TSliceType::RegionType(origin, size));
+			slice->Allocate();
+			available.push_back(slice);
+		}
+	}
+
+	/**
+	 * Returns a free buffer, waiting for an encoding to finish if needed.
+	 */
+	typename TSliceType::Pointer acquire()
+	{
+		QMutexLocker locker(&mutex);
+		while(available.empty())
+			released.wait(&mutex);
+
+		typename TSliceType::Pointer slice = available.back();
+		available.pop_back();
+		return slice;
+	}
+
+	void release(const typename TSliceType::Pointer &slice)
+	{
+		QMutexLocker locker(&mutex);
+		available.push_back(slice);
+		released.wakeOne();
+	}
+
+	void setError(const std::string &description)
+	{
+		QMutexLocker locker(&mutex);
+		if(error.empty())
+			error = description;
+	}
+
+	std::string getError()
+	{
+		QMutexLocker locker(&mutex);
+		return error;
+	}
+};
+
+/**
+ * Encodes a filled slice into its file, then gives the buffer back.
+ */
+template <typename TSliceType>
+class EncodeSliceTask : public QRunnable
+{
+private:
+	SliceBuffers< TSliceType > &buffers;
+	typename TSliceType::Pointer slice;
+	const std::string file;
+
+public:
+	EncodeSliceTask(SliceBuffers< TSliceType > &buffers, const typename TSliceType::Pointer &slice, const std::string &file) :
+		buffers(buffers), slice(slice), file(file)
+	{}
+
+	void run()
+	{
+		try {
+			typename itk::ImageFileWriter< TSliceType >::Pointer writer = itk::ImageFileWriter< TSliceType >::New();
+			writer->SetInput(slice);
+			writer->SetFileName(file);
+			writer->Update();
+		} catch(itk::ExceptionObject &err) {
+			std::stringstream e; e << "The image cannot be exported: " << err.GetDescription();
+			buffers.setError(e.str());
+		}
+
+		buffers.release(slice);
+	}
+};
+
+/**
+ * Writes the nodes of a width x height x depth grid, one Z-slice per file.
+ *
+ * Each slice is filled in a reusable 2D buffer by the calling thread
+ * (converter(node, pixel) is called for each voxel, in raster order), then
+ * encoded by the thread pool while the next slice is filled. At most
+ * maxThreadCount() + 1 slices are held in memory.
+ */
+template <typename TPixel, typename TConverter>
+void writeSliceSeries(const VoxelNodeMap &nodes, const uint64_t width, const uint64_t height, const uint64_t depth,
+                      const std::vector< std::string > &files, const TConverter &converter, QThreadPool &pool, tlp::PluginProgress *pluginProgress = NULL)
+{
+	typedef itk::Image< TPixel, 2 > SliceType;
+
+	if(files.size() < depth)
+		throw std::runtime_error("Not enough file names for the slices of the image");
+
+	SliceBuffers< SliceType > buffers(pool.maxThreadCount() + 1, width, height);
+	const uint64_t sliceSize = width * height;
+	ProgressReporter progress(pluginProgress);
+
+	for(uint64_t z = 0; z < depth; ++z) {
+		typename SliceType::Pointer slice = buffers.acquire();
+		if(!buffers.getError().empty()) {
+			buffers.release(slice);
+			break;
+		}
+
+		// Voxels without a node, in a sparse grid, are written as 0.
+		const TPixel background = TPixel();
+		TPixel *pixel = slice->GetBufferPointer();
+		for(uint64_t i = 0; i < sliceSize; ++i, ++pixel) {
+			const tlp::node n = nodes[z * sliceSize + i];
+			if(n.isValid())
+				converter(n, *pixel);
+			else
+				*pixel = background;
+		}
+
+		pool.start(new EncodeSliceTask< SliceType >(buffers, slice, files[z]));
+
+		try {
+			progress.update(z + 1, depth);
+		} catch(ProgressInterruption &) {
+			// The slices being encoded are still written.
+			pool.waitForDone();
+			throw;
+		}
+	}
+
+	pool.waitForDone();
+
+	const std::string error = buffers.getError();
+	if(!error.empty())
+		throw std::runtime_error(error);
+}
+
+#endif /* SLICESERIESWRITER_H */
@@ -0,0 +1,67 @@
+#ifndef THREADPOOLUTILS_H
+#define THREADPOOLUTILS_H
+
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+
+#include <algorithm>
+#include <stdint.h>
+
+/**
+ * Number of threads to use, 0 meaning one per core.
+ */
+inline int threadCount(const unsigned int requested)
+{
+	if(requested > 0)
+		return requested;
+
+	const int ideal = QThread::idealThreadCount();
+	return ideal > 0 ? ideal : 1;
+}
+
+template <typename TTask>
+class RangeRunnable : public QRunnable
+{
+private:
+	const TTask &task;
+	const uint64_t begin, end;
+
+public:
+	RangeRunnable(const TTask &task, const uint64_t begin, const uint64_t end) :
+		task(task), begin(begin), end(end)
+	{}
+
+	void run()
+	{
+		task(begin, end);
+	}
+};
+
+/**
+ * Splits [begin, end) in contiguous ranges, one per thread of the pool, and
+ * calls task(rangeBegin, rangeEnd) for each of them. Returns once all the
+ * ranges have been processed. With a single thread, the task is called
+ * directly from the calling thread.
+ *
+ * The task must not throw.
+ */
+template <typename TTask>
+void parallelFor(QThreadPool &pool, const uint64_t begin, const uint64_t end, const TTask &task)
+{
+	const uint64_t length = end - begin;
+	const uint64_t numberOfRanges = std::min< uint64_t >(pool.maxThreadCount(), length);
+
+	if(numberOfRanges <= 1) {
+		if(length > 0)
+			task(begin, end);
+		return;
+	}
+
+	for(uint64_t i = 0; i < numberOfRanges; ++i)
+		pool.start(new RangeRunnable< TTask >(task, begin + length * i / numberOfRanges, begin + length * (i + 1) / numberOfRanges));
+
+	pool.waitForDone();
+}
+
+#endif /* THREADPOOLUTILS_H */
@@ -0,0 +1,102 @@
+#include <QFileInfo>
+#include <QDateTime>
+#include <QMutexLocker>
+
+#include "VolumeCache.h"
+
+namespace {
+void fileStamp(const std::string &file, long long &modified, long long &size)
+{
+	const QFileInfo info(QString::fromStdString(file));
+	// In ms, a file rewritten within the same second must not hit the cache.
+	modified = info.lastModified().toMSecsSinceEpoch();
+	size = info.size();
+}
+}
+
+VolumeCache::VolumeCache() :
+	budget(0), bytes(0), hits(0), misses(0)
+{}
+
+VolumeCache& VolumeCache::instance()
+{
+	static VolumeCache cache;
+	return cache;
+}
+
+void VolumeCache::setBudget(const unsigned long long budget)
+{
+	QMutexLocker locker(&mutex);
+	this->budget = budget;
+	evict();
+}
+
+itk::DataObject::Pointer VolumeCache::find(const std::string &file, const itk::ImageIOBase::IOComponentType componentType)
+{
+	long long modified, fileSize;
+	fileStamp(file, modified, fileSize);
+
+	QMutexLocker locker(&mutex);
+	for(std::list< Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+		if(it->file == file && it->componentType == componentType) {
+			if(it->modified != modified || it->fileSize != fileSize) {
+				// The file has changed since it has been cached.
+				bytes -= it->bytes;
+				entries.erase(it);
+				break;
+			}
+
+			entries.splice(entries.begin(), entries, it);
+			++hits;
+			return entries.front().image;
+		}
+	}
+
+	++misses;
+	return NULL;
+}
+
+void VolumeCache::insert(const std::string &file, const itk::ImageIOBase::IOComponentType componentType, itk::DataObject *image, const unsigned long long bytes)
+{
+	Entry entry;
+	entry.file = file;
+	entry.componentType = componentType;
+	entry.image = image;
+	entry.bytes = bytes;
+	fileStamp(file, entry.modified, entry.fileSize);
+
+	QMutexLocker locker(&mutex);
+	if(bytes > budget)
+		return;
+
+	for(std::list< Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+		if(it->file == file && it->componentType == componentType) {
+			this->bytes -= it->bytes;
+			entries.erase(it);
+			break;
+		}
+	}
+
+	entries.push_front(entry);
+	this->bytes += bytes;
+	evict();
+}
+
+VolumeCache::Statistics VolumeCache::statistics()
+{
+	QMutexLocker locker(&mutex);
+	Statistics statistics;
+	statistics.hits = hits;
+	statistics.misses = misses;
+	statistics.entries = entries.size();
+	statistics.bytes = bytes;
+	return statistics;
+}
+
+void VolumeCache::evict()
+{
+	while(bytes > budget && !entries.empty()) {
+		bytes -= entries.back().bytes;
+		entries.pop_back();
+	}
+}
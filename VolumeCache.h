@@ -0,0 +1,109 @@
+#ifndef VOLUMECACHE_H
+#define VOLUMECACHE_H
+
+#include <itkImageIOBase.h>
+#include <itkDataObject.h>
+
+#include <QMutex>
+
+#include <list>
+#include <string>
+
+#include "ImageIOUtils.h"
+
+/**
+ * Process-wide LRU cache of decoded images, shared by the plugins so that
+ * loading the same file again does not decode it again.
+ *
+ * Images are identified by their path, modification time, file size and
+ * component type. The least recently used images are dropped once the total
+ * size of the cached images exceeds the budget. Images still in use by a
+ * caller stay alive until released, even when dropped from the cache.
+ */
+class VolumeCache
+{
+public:
+	struct Statistics
+	{
+		unsigned long hits, misses, entries;
+		unsigned long long bytes;
+	};
+
+	static VolumeCache& instance();
+
+	/**
+	 * Sets the budget (in bytes), dropping images if needed.
+	 */
+	void setBudget(const unsigned long long budget);
+
+	/**
+	 * Returns the cached image, or NULL when it is not cached.
+	 * Counts a hit or a miss.
+	 */
+	itk::DataObject::Pointer find(const std::string &file, const itk::ImageIOBase::IOComponentType componentType);
+
+	/**
+	 * Caches an image of the given size (in bytes), unless it is larger than
+	 * the budget.
+	 */
+	void insert(const std::string &file, const itk::ImageIOBase::IOComponentType componentType, itk::DataObject *image, const unsigned long long bytes);
+
+	Statistics statistics();
+
+private:
+	struct Entry
+	{
+		std::string file;
+		long long modified, fileSize;
+		itk::ImageIOBase::IOComponentType componentType;
+		itk::DataObject::Pointer image;
+		unsigned long long bytes;
+	};
+
+	QMutex mutex;
+	std::list< Entry > entries; // Most recently used first.
+	unsigned long long budget, bytes;
+	unsigned long hits, misses;
+
+	VolumeCache();
+	VolumeCache(const VolumeCache&);
+	VolumeCache& operator=(const VolumeCache&);
+
+	void evict();
+};
+
+/**
+ * Decodes an image like ReadImageVisitor, through the cache when the budget
+ * (in MB) is not 0.
+ */
+inline itk::DataObject::Pointer readCachedImage(const std::string &file, const itk::ImageIOBase::IOComponentType componentType, const unsigned int budget)
+{
+	VolumeCache &cache = VolumeCache::instance();
+	if(budget > 0) {
+		cache.setBudget(budget * 1024ULL * 1024ULL);
+
+		itk::DataObject::Pointer image = cache.find(file, componentType);
+		if(image.IsNotNull())
+			return image;
+	}
+
+	ReadImageVisitor reader(file);
+	dispatchComponentType(componentType, reader);
+
+	if(budget > 0)
+		cache.insert(file, componentType, reader.image, reader.bytes);
+
+	return reader.image;
+}
+
+/**
+ * Stores the hit and miss counts of the cache in the attributes of the graph.
+ */
+inline void storeCacheStatistics(tlp::Graph *graph)
+{
+	const VolumeCache::Statistics statistics = VolumeCache::instance().statistics();
+	graph->setAttribute< unsigned int >("image3d_cache_hits", statistics.hits);
+	graph->setAttribute< unsigned int >("image3d_cache_misses", statistics.misses);
+}
+
+#endif /* VOLUMECACHE_H */
@@ -0,0 +1,170 @@
+#ifndef VOXELMASK_H
+#define VOXELMASK_H
+
+#include <itkVectorImage.h>
+
+#include <algorithm>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ImageIOUtils.h"
+#include "ImageSampling.h"
+#include "ProgressUtils.h"
+#include "ThreadPoolUtils.h"
+
+/**
+ * Mask of a sparse grid, one bit per voxel. Each slice starts on a new word,
+ * so that different slices can be written by different threads.
+ */
+class VoxelMask
+{
+private:
+	static const unsigned int WORD_BITS = 32;
+
+	uint64_t sliceSize, wordsPerSlice;
+	std::vector< unsigned int > words;
+
+public:
+	VoxelMask() :
+		sliceSize(0), wordsPerSlice(0)
+	{}
+
+	/**
+	 * Clears the mask and resizes it to depth slices of sliceSize voxels.
+	 */
+	void assign(const uint64_t sliceSize, const uint64_t depth)
+	{
+		this->sliceSize = sliceSize;
+		this->wordsPerSlice = (sliceSize + WORD_BITS - 1) / WORD_BITS;
+		words.assign(wordsPerSlice * depth, 0);
+	}
+
+	bool empty() const { return words.empty(); }
+
+	void swap(VoxelMask &other)
+	{
+		std::swap(sliceSize, other.sliceSize);
+		std::swap(wordsPerSlice, other.wordsPerSlice);
+		words.swap(other.words);
+	}
+
+	void set(const uint64_t voxel)
+	{
+		const uint64_t i = voxel % sliceSize;
+		words[voxel / sliceSize * wordsPerSlice + i / WORD_BITS] |= 1u << (i % WORD_BITS);
+	}
+
+	bool operator[](const uint64_t voxel) const
+	{
+		const uint64_t i = voxel % sliceSize;
+		return (words[voxel / sliceSize * wordsPerSlice + i / WORD_BITS] >> (i % WORD_BITS)) & 1u;
+	}
+
+	/**
+	 * Number of voxels of the mask.
+	 */
+	uint64_t count() const
+	{
+		uint64_t n = 0;
+		for(std::vector< unsigned int >::const_iterator w = words.begin(); w != words.end(); ++w) {
+			unsigned int v = *w;
+			for(; v != 0; ++n)
+				v &= v - 1;
+		}
+		return n;
+	}
+};
+
+/**
+ * Marks the kept voxels of a range of slices of a slab whose first component
+ * is greater than the threshold. Each slice is written by a single thread.
+ */
+template <typename TVectorImageType>
+class MaskSlicesTask
+{
+private:
+	const TVectorImageType *image;
+	const SampledRegion &slab;
+	const ImageSampling &sampling;
+	const double threshold;
+	VoxelMask &mask;
+
+public:
+	MaskSlicesTask(const TVectorImageType *image, const SampledRegion &slab, const ImageSampling &sampling, const double threshold, VoxelMask &mask) :
+		image(image), slab(slab), sampling(sampling), threshold(threshold), mask(mask)
+	{}
+
+	void operator()(const uint64_t begin, const uint64_t end) const
+	{
+		const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+		const typename TVectorImageType::InternalPixelType *buffer = image->GetBufferPointer();
+		const uint64_t gridWidth = sampling.gridSize(0), gridSliceSize = gridWidth * sampling.gridSize(1);
+		const uint64_t gx = (slab.start[0] - sampling.index[0]) / sampling.stride[0];
+
+		typename TVectorImageType::IndexType index;
+		index[0] = slab.start[0];
+		for(uint64_t z = begin; z < end; ++z) {
+			index[2] = slab.start[2] + z * slab.stride[2];
+			const uint64_t gz = (index[2] - sampling.index[2]) / sampling.stride[2];
+			for(uint64_t y = 0; y < slab.count[1]; ++y) {
+				index[1] = slab.start[1] + y * slab.stride[1];
+				const uint64_t gy = (index[1] - sampling.index[1]) / sampling.stride[1];
+
+				const typename TVectorImageType::InternalPixelType *pixel = buffer + image->ComputeOffset(index) * numberOfComponents;
+				const uint64_t voxel = gx + gy * gridWidth + gz * gridSliceSize;
+				for(uint64_t x = 0; x < slab.count[0]; ++x, pixel += slab.stride[0] * numberOfComponents) {
+					if(*pixel > threshold)
+						mask.set(voxel + x);
+				}
+			}
+		}
+	}
+};
+
+/**
+ * Computes the mask of a sparse grid from an image, streamed slab by slab:
+ * one bit per voxel kept by the sampling, set when the first component of
+ * the voxel is greater than the threshold.
+ */
+class MaskVisitor
+{
+private:
+	const std::string &file;
+	const uint64_t slabDepth;
+	const ImageSampling &sampling;
+	const double threshold;
+	QThreadPool &pool;
+	tlp::PluginProgress *pluginProgress;
+
+public:
+	VoxelMask mask;
+
+	MaskVisitor(const std::string &file, const uint64_t slabDepth, const ImageSampling &sampling, const double threshold, QThreadPool &pool,
+	            tlp::PluginProgress *pluginProgress = NULL) :
+		file(file), slabDepth(slabDepth), sampling(sampling), threshold(threshold), pool(pool), pluginProgress(pluginProgress)
+	{}
+
+	template <typename TPixel>
+	void visit()
+	{
+		typedef typename SlabReader< TPixel >::ImageType ImageType;
+		SlabReader< TPixel > reader(file, slabDepth, sampling);
+
+		const typename ImageType::SizeType size = reader.image()->GetLargestPossibleRegion().GetSize();
+		const uint64_t imageSize[3] = { size[0], size[1], size[2] };
+		const ImageSampling resolved = resolveSampling(sampling, imageSize);
+
+		ProgressReporter progress(pluginProgress);
+		mask.assign(resolved.gridSize(0) * resolved.gridSize(1), resolved.gridSize(2));
+		while(reader.next()) {
+			const SampledRegion slab = sampledRegion(resolved, reader.region());
+			if(slab.numberOfPixels() > 0)
+				parallelFor(pool, 0, slab.count[2], MaskSlicesTask< ImageType >(reader.image(), slab, resolved, threshold, mask));
+
+			progress.update(reader.region().GetIndex(2) + reader.region().GetSize(2), size[2]);
+		}
+	}
+};
+
+#endif /* VOXELMASK_H */
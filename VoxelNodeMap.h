@@ -0,0 +1,308 @@
+#ifndef VOXELNODEMAP_H
+#define VOXELNODEMAP_H
+
+#include <climits>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+#include "GridAttributes.h"
+
+/**
+ * Name of the graph attribute holding the id of the node of the first voxel,
+ * when the ids of the nodes of the grid are contiguous, in raster order.
+ */
+const char* const FIRST_NODE_ATTRIBUTE = "image3d_first_node";
+
+/**
+ * Name of the node property holding the linear index of the voxel of each
+ * node, when the ids are not contiguous (e.g. in a sparse grid). A
+ * DoubleProperty, as voxel indexes may not fit in an int (they are exact up
+ * to 2^53).
+ */
+const char* const VOXEL_INDEX_PROPERTY = "image3d_voxel_index";
+
+/**
+ * Maximum number of nodes of a grid, node ids being unsigned int.
+ */
+const uint64_t MAX_GRID_NODES = UINT_MAX - 1;
+
+/**
+ * Records the node of each voxel of a grid, as the nodes are created (in
+ * increasing voxel order, voxels without a node being skipped): the id of the
+ * first node when the ids are contiguous, the voxel of each node otherwise.
+ * Nothing but the last node is kept in memory.
+ */
+class VoxelIndexBuilder
+{
+private:
+	tlp::Graph *graph;
+	unsigned int firstId;
+	uint64_t count;
+	bool contiguous;
+	tlp::DoubleProperty *voxels;
+
+public:
+	VoxelIndexBuilder(tlp::Graph *graph) :
+		graph(graph), firstId(0), count(0), contiguous(true), voxels(NULL)
+	{}
+
+	void add(const uint64_t voxel, const tlp::node n)
+	{
+		if(contiguous) {
+			if(count == 0)
+				firstId = n.id;
+
+			if(voxel == count && n.id == firstId + voxel) {
+				++count;
+				return;
+			}
+
+			// The previous nodes were contiguous, their voxels are computed from their ids.
+			contiguous = false;
+			voxels = graph->getProperty< tlp::DoubleProperty >(VOXEL_INDEX_PROPERTY);
+			for(uint64_t v = 0; v < count; ++v)
+				voxels->setNodeValue(tlp::node(firstId + v), v);
+		}
+
+		voxels->setNodeValue(n, voxel);
+	}
+
+	/**
+	 * Must be called once all the nodes have been added.
+	 */
+	void finish()
+	{
+		if(contiguous && count > 0)
+			graph->setAttribute< unsigned int >(FIRST_NODE_ATTRIBUTE, firstId);
+	}
+};
+
+/**
+ * Stores the index of a grid, given the node of each voxel in raster order
+ * (invalid for the voxels without a node).
+ */
+inline void storeVoxelIndex(tlp::Graph *graph, const std::vector< tlp::node > &nodes)
+{
+	VoxelIndexBuilder index(graph);
+	for(uint64_t v = 0; v < nodes.size(); ++v) {
+		if(nodes[v].isValid())
+			index.add(v, nodes[v]);
+	}
+	index.finish();
+}
+
+/**
+ * Number of bits set in a word.
+ */
+inline unsigned int popCount(unsigned int v)
+{
+	v = v - ((v >> 1) & 0x55555555u);
+	v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+	return (((v + (v >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+/**
+ * Maps the linear index of a voxel (in raster order) to the node representing
+ * it, and back.
+ *
+ * The mapping is read from the index stored by the "Import image" plugin (see
+ * storeVoxelIndex), so it does not depend on the order of the nodes in the
+ * graph. On a subgraph, or after nodes have been deleted, the voxels whose
+ * node is not in the graph are mapped to an invalid node, as well as the
+ * voxels without a node in a sparse grid.
+ *
+ * Graphs imported without an index are expected to list their nodes in
+ * raster order.
+ *
+ * When the node of a voxel cannot be computed from the id of the first node,
+ * the map holds either a table of the node of each voxel (4 bytes per voxel),
+ * or, when less than half of the voxels have a node (sparse grids, small
+ * subgraphs), a bitset of the voxels having a node, the number of nodes
+ * before each word of the bitset, and the nodes in voxel order (2 bits per
+ * voxel and 4 bytes per node). Lookups are in O(1) in both cases.
+ */
+class VoxelNodeMap
+{
+private:
+	static const unsigned int WORD_BITS = 32;
+
+	unsigned int firstId;
+	uint64_t numberOfVoxels;
+	bool contiguous;
+	// Node of each voxel, when it cannot be computed from firstId.
+	std::vector< tlp::node > table;
+	// Instead of the table for sparse maps: one bit per voxel having a node,
+	// the number of bits set before each word, and the node of each bit set.
+	std::vector< unsigned int > bits, ranks;
+	std::vector< tlp::node > sparse;
+	// Voxel of each node, by id, for graphs without index and with non contiguous ids.
+	std::vector< uint64_t > voxels;
+	tlp::DoubleProperty *voxelIndex;
+
+	uint64_t gridSize(tlp::Graph *graph) const
+	{
+		int width = 0, height = 0, depth = 0;
+		getGridDimensions(graph, width, height, depth);
+		return (uint64_t)width * height * depth;
+	}
+
+	/**
+	 * Voxel of a node, read from the index or computed from firstId. Returns
+	 * false for the nodes outside of the grid (not created by the import).
+	 */
+	bool voxelOf(const tlp::node n, uint64_t &voxel) const
+	{
+		if(voxelIndex != NULL) {
+			const double v = voxelIndex->getNodeValue(n);
+			if(v < 0 || v >= numberOfVoxels)
+				throw std::runtime_error("The voxel index of a node is outside of the image");
+			voxel = (uint64_t)v;
+			return true;
+		}
+
+		voxel = n.id - firstId;
+		return n.id >= firstId && voxel < numberOfVoxels;
+	}
+
+	/**
+	 * Fills the table, or the sparse bitset when less than half of the voxels
+	 * have a node, from the voxel of each node of the graph.
+	 */
+	void readNodes(tlp::Graph *graph)
+	{
+		contiguous = false;
+		uint64_t voxel;
+		tlp::node n;
+
+		if(graph->numberOfNodes() >= numberOfVoxels / 2) {
+			table.assign(numberOfVoxels, tlp::node());
+			forEach(n, graph->getNodes())
+			{
+				if(voxelOf(n, voxel))
+					table[voxel] = n;
+			}
+		} else {
+			bits.assign((numberOfVoxels + WORD_BITS - 1) / WORD_BITS, 0);
+			forEach(n, graph->getNodes())
+			{
+				if(voxelOf(n, voxel))
+					bits[voxel / WORD_BITS] |= 1u << (voxel % WORD_BITS);
+			}
+
+			ranks.resize(bits.size());
+			unsigned int rank = 0;
+			for(uint64_t w = 0; w < bits.size(); ++w) {
+				ranks[w] = rank;
+				rank += popCount(bits[w]);
+			}
+
+			sparse.resize(rank);
+			forEach(n, graph->getNodes())
+			{
+				if(voxelOf(n, voxel))
+					sparse[this->rank(voxel)] = n;
+			}
+		}
+	}
+
+	/**
+	 * Number of voxels having a node before this one, in a sparse map.
+	 */
+	unsigned int rank(const uint64_t voxel) const
+	{
+		const unsigned int bit = voxel % WORD_BITS;
+		return ranks[voxel / WORD_BITS] + popCount(bits[voxel / WORD_BITS] & ((1u << bit) - 1));
+	}
+
+	void readVoxelIndex(tlp::Graph *graph)
+	{
+		numberOfVoxels = gridSize(graph);
+		voxelIndex = graph->getProperty< tlp::DoubleProperty >(VOXEL_INDEX_PROPERTY);
+		readNodes(graph);
+	}
+
+	void readFirstNode(tlp::Graph *graph)
+	{
+		numberOfVoxels = gridSize(graph);
+
+		// Some voxels have no node in this graph.
+		if(graph->numberOfNodes() != numberOfVoxels)
+			readNodes(graph);
+	}
+
+	void readNodeOrder(tlp::Graph *graph)
+	{
+		tlp::node n;
+		forEach(n, graph->getNodes())
+		{
+			if(numberOfVoxels == 0)
+				firstId = n.id;
+
+			if(contiguous && n.id != firstId + numberOfVoxels) {
+				contiguous = false;
+				table.reserve(graph->numberOfNodes());
+				for(uint64_t i = 0; i < numberOfVoxels; ++i)
+					table.push_back(tlp::node(firstId + i));
+			}
+
+			if(!contiguous)
+				table.push_back(n);
+
+			++numberOfVoxels;
+		}
+
+		for(uint64_t v = 0; v < table.size(); ++v) {
+			if(table[v].id >= voxels.size())
+				voxels.resize(table[v].id + 1);
+			voxels[table[v].id] = v;
+		}
+	}
+
+public:
+	VoxelNodeMap(tlp::Graph *graph) :
+		firstId(0), numberOfVoxels(0), contiguous(true), voxelIndex(NULL)
+	{
+		if(graph->existProperty(VOXEL_INDEX_PROPERTY))
+			readVoxelIndex(graph);
+		else if(getGridAttribute< unsigned int >(graph, FIRST_NODE_ATTRIBUTE, firstId))
+			readFirstNode(graph);
+		else
+			readNodeOrder(graph);
+	}
+
+	/**
+	 * Number of voxels, including the ones without a node.
+	 */
+	uint64_t size() const { return numberOfVoxels; }
+
+	bool isContiguous() const { return contiguous; }
+
+	/**
+	 * Node of the voxel, invalid if the voxel has none.
+	 */
+	tlp::node operator[](const uint64_t voxel) const
+	{
+		if(contiguous)
+			return tlp::node(firstId + voxel);
+		if(!table.empty())
+			return table[voxel];
+		if(((bits[voxel / WORD_BITS] >> (voxel % WORD_BITS)) & 1u) == 0)
+			return tlp::node();
+		return sparse[rank(voxel)];
+	}
+
+	/**
+	 * Voxel of a node of the graph.
+	 */
+	uint64_t voxel(const tlp::node n) const
+	{
+		if(voxelIndex != NULL)
+			return (uint64_t)voxelIndex->getNodeValue(n);
+		if(!voxels.empty())
+			return voxels[n.id];
+		return n.id - firstId;
+	}
+};
+
+#endif /* VOXELNODEMAP_H */
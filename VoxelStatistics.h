@@ -0,0 +1,273 @@
+#ifndef VOXELSTATISTICS_H
+#define VOXELSTATISTICS_H
+
+#include <tulip/Graph.h>
+
+#include <itkImageIOBase.h>
+
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <climits>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Statistics of the values of one component: count, min, max, mean and the
+ * sum of the squared differences to the mean (m2, the variance being
+ * m2 / count), and an optional histogram.
+ */
+struct ComponentStatistics
+{
+	unsigned long long count;
+	double min, max, mean, m2;
+	std::vector< unsigned long long > histogram;
+
+	ComponentStatistics(const unsigned int bins = 0) :
+		count(0), min(std::numeric_limits< double >::max()), max(-std::numeric_limits< double >::max()), mean(0), m2(0), histogram(bins, 0)
+	{}
+
+	/**
+	 * Merges the statistics of another set of values (Chan et al.).
+	 */
+	void merge(const unsigned long long otherCount, const double otherMin, const double otherMax, const double otherMean, const double otherM2)
+	{
+		if(otherCount == 0)
+			return;
+
+		const double n = count + otherCount;
+		const double delta = otherMean - mean;
+		mean += delta * otherCount / n;
+		m2 += otherM2 + delta * delta * ((double)count * otherCount / n);
+		count += otherCount;
+		min = std::min(min, otherMin);
+		max = std::max(max, otherMax);
+	}
+};
+
+/**
+ * Per-component statistics of the voxels loaded into the properties,
+ * accumulated by the fill threads in the same pass as the conversion (see
+ * StatisticsAccumulator) and merged at the end of each batch.
+ *
+ * The histogram has a fixed number of bins over [low, high]. Values outside
+ * of the range are counted in the first or last bin.
+ */
+class VoxelStatistics
+{
+private:
+	unsigned int bins;
+	double low, high;
+	std::vector< ComponentStatistics > components;
+	QMutex mutex;
+
+public:
+	VoxelStatistics() :
+		bins(0), low(0), high(0)
+	{}
+
+	/**
+	 * Enables the histogram, bins == 0 disabling it. Must be called before
+	 * the values are accumulated.
+	 */
+	void setHistogram(const unsigned int bins, const double low, const double high)
+	{
+		this->bins = high > low ? bins : 0;
+		this->low = low;
+		this->high = high;
+	}
+
+	unsigned int numberOfBins() const { return bins; }
+	double histogramLow() const { return low; }
+	double histogramHigh() const { return high; }
+
+	const std::vector< ComponentStatistics >& statistics() const { return components; }
+
+	void merge(const std::vector< ComponentStatistics > &other)
+	{
+		QMutexLocker locker(&mutex);
+
+		if(components.size() < other.size())
+			components.resize(other.size(), ComponentStatistics(bins));
+
+		for(unsigned int c = 0; c < other.size(); ++c) {
+			components[c].merge(other[c].count, other[c].min, other[c].max, other[c].mean, other[c].m2);
+			for(unsigned int b = 0; b < bins; ++b)
+				components[c].histogram[b] += other[c].histogram[b];
+		}
+	}
+
+	/**
+	 * Stores the statistics in graph attributes, one value per component:
+	 * <prefix>_min, <prefix>_max, <prefix>_mean and <prefix>_variance
+	 * (vectors of double), and, with a histogram, <prefix>_histogram_range
+	 * (low, high) and <prefix>_histogram_<component> (the count of each bin).
+	 */
+	void store(tlp::Graph *graph, const std::string &prefix) const
+	{
+		std::vector< double > min, max, mean, variance;
+		for(unsigned int c = 0; c < components.size(); ++c) {
+			const ComponentStatistics &s = components[c];
+			min.push_back(s.count > 0 ? s.min : 0);
+			max.push_back(s.count > 0 ? s.max : 0);
+			mean.push_back(s.mean);
+			variance.push_back(s.count > 0 ? s.m2 / s.count : 0);
+		}
+
+		graph->setAttribute< std::vector< double > >(prefix + "_min", min);
+		graph->setAttribute< std::vector< double > >(prefix + "_max", max);
+		graph->setAttribute< std::vector< double > >(prefix + "_mean", mean);
+		graph->setAttribute< std::vector< double > >(prefix + "_variance", variance);
+
+		if(bins == 0)
+			return;
+
+		std::vector< double > range;
+		range.push_back(low);
+		range.push_back(high);
+		graph->setAttribute< std::vector< double > >(prefix + "_histogram_range", range);
+
+		for(unsigned int c = 0; c < components.size(); ++c) {
+			std::ostringstream name; name << prefix << "_histogram_" << c;
+			const std::vector< double > counts(components[c].histogram.begin(), components[c].histogram.end());
+			graph->setAttribute< std::vector< double > >(name.str(), counts);
+		}
+	}
+};
+
+/**
+ * Accumulates the statistics of the pixels converted by one thread, merged
+ * into the shared VoxelStatistics once the thread is done. The sums are
+ * shifted by the first value of each component to limit the loss of
+ * precision of the variance.
+ */
+template <typename TPixel>
+class StatisticsAccumulator
+{
+private:
+	const unsigned int numberOfComponents;
+	const unsigned int bins;
+	const double low, scale;
+	std::vector< unsigned long long > count;
+	std::vector< TPixel > min, max;
+	std::vector< double > shift, sum, sumOfSquares;
+	std::vector< unsigned long long > histogram;
+
+public:
+	/**
+	 * Empty accumulator, for the passes without statistics.
+	 */
+	StatisticsAccumulator() :
+		numberOfComponents(0), bins(0), low(0), scale(0)
+	{}
+
+	StatisticsAccumulator(const VoxelStatistics &statistics, const unsigned int numberOfComponents) :
+		numberOfComponents(numberOfComponents), bins(statistics.numberOfBins()), low(statistics.histogramLow()),
+		scale(bins > 0 ? bins / (statistics.histogramHigh() - statistics.histogramLow()) : 0),
+		count(numberOfComponents, 0), min(numberOfComponents), max(numberOfComponents),
+		shift(numberOfComponents, 0), sum(numberOfComponents, 0), sumOfSquares(numberOfComponents, 0),
+		histogram(numberOfComponents * bins, 0)
+	{}
+
+	/**
+	 * Adds numberOfPixels pixels, "step" values apart.
+	 */
+	void add(const TPixel *pixel, const uint64_t numberOfPixels, const uint64_t step)
+	{
+		for(unsigned int c = 0; c < numberOfComponents; ++c) {
+			const TPixel *value = pixel + c;
+			if(count[c] == 0) {
+				min[c] = max[c] = *value;
+				shift[c] = *value;
+			}
+
+			TPixel componentMin = min[c], componentMax = max[c];
+			double componentSum = 0, componentSumOfSquares = 0;
+			unsigned long long *componentHistogram = bins > 0 ? &histogram[c * bins] : NULL;
+			for(uint64_t i = 0; i < numberOfPixels; ++i, value += step) {
+				const TPixel v = *value;
+				componentMin = std::min(componentMin, v);
+				componentMax = std::max(componentMax, v);
+
+				const double d = v - shift[c];
+				componentSum += d;
+				componentSumOfSquares += d * d;
+
+				if(componentHistogram != NULL) {
+					// NaN values are counted in the first bin.
+					const double bin = (v - low) * scale;
+					++componentHistogram[!(bin > 0) ? 0 : bin >= bins ? bins - 1 : (unsigned int)bin];
+				}
+			}
+
+			min[c] = componentMin;
+			max[c] = componentMax;
+			sum[c] += componentSum;
+			sumOfSquares[c] += componentSumOfSquares;
+			count[c] += numberOfPixels;
+		}
+	}
+
+	void mergeInto(VoxelStatistics &statistics) const
+	{
+		std::vector< ComponentStatistics > components(numberOfComponents, ComponentStatistics(bins));
+		for(unsigned int c = 0; c < numberOfComponents; ++c) {
+			if(count[c] == 0)
+				continue;
+
+			const double mean = sum[c] / count[c];
+			components[c].count = count[c];
+			components[c].min = min[c];
+			components[c].max = max[c];
+			components[c].mean = shift[c] + mean;
+			components[c].m2 = std::max(0.0, sumOfSquares[c] - sum[c] * mean);
+			std::copy(histogram.begin() + c * bins, histogram.begin() + (c + 1) * bins, components[c].histogram.begin());
+		}
+		statistics.merge(components);
+	}
+};
+
+/**
+ * Default range of the histogram: the range of the component type for
+ * integer types. Returns false for real types, whose range is unknown before
+ * the values have been read.
+ */
+inline bool componentTypeRange(const itk::ImageIOBase::IOComponentType componentType, double &low, double &high)
+{
+	switch(componentType) {
+		case itk::ImageIOBase::UCHAR:  low = 0;        high = UCHAR_MAX + 1.0; return true;
+		case itk::ImageIOBase::USHORT: low = 0;        high = USHRT_MAX + 1.0; return true;
+		case itk::ImageIOBase::SHORT:  low = SHRT_MIN; high = SHRT_MAX + 1.0;  return true;
+		case itk::ImageIOBase::INT:    low = INT_MIN;  high = INT_MAX + 1.0;   return true;
+		default:                       return false;
+	}
+}
+
+/**
+ * Sets the histogram of the value statistics of an import or a load: bins
+ * over the "Histogram range" parameter ("low,high"), or over the range of the
+ * component type when it is empty. Real types have no histogram without a
+ * range.
+ */
+inline void setHistogramParameters(VoxelStatistics &statistics, const unsigned int bins, const std::string &range, const itk::ImageIOBase::IOComponentType componentType)
+{
+	double low = 0, high = 0;
+	if(range.find_first_not_of(" \t") != std::string::npos) {
+		std::istringstream in(range);
+		char comma = 0;
+		in >> low >> comma >> high;
+		if(in.fail() || comma != ',' || !(in >> std::ws).eof() || high <= low)
+			throw std::runtime_error("The \"Histogram range\" parameter must be of the form low,high, with low < high");
+	} else if(!componentTypeRange(componentType, low, high)) {
+		return;
+	}
+
+	statistics.setHistogram(bins, low, high);
+}
+
+#endif /* VOXELSTATISTICS_H */